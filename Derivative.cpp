@@ -2,6 +2,13 @@
 #include <limits>
 #include <cmath>
 #include <cassert>
+#include <unordered_map>
+#include <unordered_set>
+#include <set>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
 #include "Derivative.h"
 
 using std::function;
@@ -44,7 +51,36 @@ ptrDerivativeNode newDerivativeDivideNode(const ptrDerivativeNode& a, const ptrD
     return ptrDerivativeNode(new DerivativeDivideNode(a, b));
 }
 
+ptrDerivativeNode newDerivativeIntPowNode(const ptrDerivativeNode& a, int n){
+    if(n == 0)
+        return ptrDerivativeNode(new ConstantDerivativeNode(1));
+    if(n == 1) return a;
+
+    return ptrDerivativeNode(new DerivativeIntPowNode(a, n));
+}
+
+ptrDerivativeNode newDerivativeSqrtNode(const ptrDerivativeNode& a){
+    return ptrDerivativeNode(new DerivativeSqrtNode(a));
+}
+
 ptrDerivativeNode newDerivativePowNode(const ptrDerivativeNode& a, double p){
+    // Integer and half integer exponent are expanded into multiplication
+    // and Sqrt, which are cheaper and more accurate than std::pow
+    if(std::abs(p) <= 64 and p == std::floor(p))
+        return newDerivativeIntPowNode(a, (int)p);
+    if(std::abs(p) <= 64 and 2*p == std::floor(2*p)){
+        // Keep Pow(0, -0.5) be inf rather than inf*0
+        if(p < 0)
+            return newDerivativeDivideNode(
+                ptrDerivativeNode(new ConstantDerivativeNode(1)),
+                newDerivativePowNode(a, -p)
+            );
+        return newDerivativeMultiplyNode(
+            newDerivativeIntPowNode(a, (int)std::floor(p)),
+            newDerivativeSqrtNode(a)
+        );
+    }
+
     return ptrDerivativeNode(new DerivativePowNode(a, p));
 }
 
@@ -55,6 +91,97 @@ ptrDerivativeNode newDerivativeExpNode(const ptrDerivativeNode& a){
 ptrDerivativeNode newDerivativeLogNode(const ptrDerivativeNode& a){
     return ptrDerivativeNode(new DerivativeLogNode(a));
 }
+
+ptrDerivativeNode newDerivativeSinNode(const ptrDerivativeNode& a){
+    return ptrDerivativeNode(new DerivativeSinNode(a));
+}
+
+ptrDerivativeNode newDerivativeCosNode(const ptrDerivativeNode& a){
+    return ptrDerivativeNode(new DerivativeCosNode(a));
+}
+
+ptrDerivativeNode newDerivativeTanhNode(const ptrDerivativeNode& a){
+    return ptrDerivativeNode(new DerivativeTanhNode(a));
+}
+
+ptrDerivativeNode newDerivativeSigmoidNode(const ptrDerivativeNode& a){
+    return ptrDerivativeNode(new DerivativeSigmoidNode(a));
+}
+
+ptrDerivativeNode newDerivativeSoftplusNode(const ptrDerivativeNode& a){
+    return ptrDerivativeNode(new DerivativeSoftplusNode(a));
+}
+
+ptrDerivativeNode newDerivativeAbsNode(const ptrDerivativeNode& a){
+    return ptrDerivativeNode(new DerivativeAbsNode(a));
+}
+
+ptrDerivativeNode newDerivativeSignNode(const ptrDerivativeNode& a){
+    return ptrDerivativeNode(new DerivativeSignNode(a));
+}
+
+ptrDerivativeNode newDerivativeSumNode(const ptrDerivativeNode& term, int begin, int end, int stride, std::shared_ptr<const DerivativeTape> tape = nullptr){
+    if(begin >= end)
+        return ptrDerivativeNode(new ConstantDerivativeNode(0));
+
+    return ptrDerivativeNode(new DerivativeSumNode(term, begin, end, stride, tape));
+}
+
+ptrDerivativeNode newDerivativePolynomialNode(const std::vector<int>& vars, const Matrix<int, Dynamic, Dynamic, RowMajor>& exps, const VectorXd& coef){
+    // Sort the terms in descending lexicographic order of exponents, and
+    // merge the terms of the same exponents
+    auto before = [&exps](int a, int b){
+        for(int lv = 0;lv < exps.cols();lv++)
+            if(exps(a, lv) != exps(b, lv))
+                return exps(a, lv) > exps(b, lv);
+        return false;
+    };
+    std::vector<int> order(exps.rows());
+    for(int lt = 0;lt < exps.rows();lt++)
+        order[lt] = lt;
+    std::sort(order.begin(), order.end(), before);
+
+    std::vector<int> rows;
+    std::vector<double> c;
+    for(int t : order){
+        if(not rows.empty() and not before(rows.back(), t))
+            c.back() += coef[t];
+        else
+            rows.push_back(t), c.push_back(coef[t]);
+    }
+
+    // Drop the zero terms and the variables no term contains
+    std::vector<int> keep_t, keep_v;
+    for(int lt = 0;lt < (int)rows.size();lt++)
+        if(c[lt] != 0)
+            keep_t.push_back(lt);
+    for(int lv = 0;lv < exps.cols();lv++)
+        for(int t : keep_t)
+            if(exps(rows[t], lv) != 0){
+                keep_v.push_back(lv);
+                break;
+            }
+
+    if(keep_t.empty())
+        return ptrDerivativeNode(new ConstantDerivativeNode(0));
+    if(keep_v.empty())
+        return ptrDerivativeNode(new ConstantDerivativeNode(c[keep_t[0]]));
+    if(keep_t.size() == 1 and keep_v.size() == 1 and c[keep_t[0]] == 1 and exps(rows[keep_t[0]], keep_v[0]) == 1)
+        return ptrDerivativeNode(new VariableDerivativeNode(vars[keep_v[0]]));
+
+    std::vector<int> new_vars;
+    Matrix<int, Dynamic, Dynamic, RowMajor> new_exps(keep_t.size(), keep_v.size());
+    VectorXd new_coef(keep_t.size());
+    for(int lv = 0;lv < (int)keep_v.size();lv++)
+        new_vars.push_back(vars[keep_v[lv]]);
+    for(int lt = 0;lt < (int)keep_t.size();lt++){
+        for(int lv = 0;lv < (int)keep_v.size();lv++)
+            new_exps(lt, lv) = exps(rows[keep_t[lt]], keep_v[lv]);
+        new_coef[lt] = c[keep_t[lt]];
+    }
+
+    return ptrDerivativeNode(new DerivativePolynomialNode(new_vars, new_exps, new_coef));
+}
    
 
 ptrDerivativeNode DerivativeNode::diffPartial(int index){
@@ -64,15 +191,33 @@ ptrDerivativeNode DerivativeNode::diffPartial(int index){
     return dp_map[index];
 }
 
+ptrDerivativeNode DerivativeNode::diffPartial(const std::vector<int>& indices){
+    assert(not indices.empty());
+    if(indices.size() == 1)
+        return diffPartial(indices[0]);
+
+    // Build from the cached partial differential of the prefix, so every
+    // distinct multi-index is built once.
+    if(not mp_map.count(indices)){
+        std::vector<int> prefix(indices.begin(), indices.end() - 1);
+        mp_map[indices] = diffPartial(prefix)->diffPartial(indices.back());
+    }
+    return mp_map[indices];
+}
+
 ptrDerivativeNode DerivativeNode::_diffPartial(int index){
     assert(0 and "DerivativeNode doesn't implement partial differential function.");
 }   
 
-double DerivativeNode::call(const VectorXd& vec) const {
+double DerivativeNode::call(const DerivativeInput& vec) const {
     assert(0 and "DerivativeNode doesn't implement call function.");
 }
 
 void DerivativeNode::print(std::ostream& stream) const {
+    printNode(stream, [&](int k){ operand(k)->print(stream); });
+}
+
+void DerivativeNode::printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const {
     assert(0 and "DerivativeNode doesn't implement print function.");
 }
 
@@ -80,6 +225,29 @@ bool DerivativeNode::isConstant(double c) const {
     return false;
 }
 
+int DerivativeNode::numOperands() const {
+    return 0;
+}
+
+ptrDerivativeNode DerivativeNode::operand(int k) const {
+    assert(0 and "DerivativeNode doesn't have operand.");
+    return nullptr;
+}
+
+void DerivativeNode::record(DerivativeTapeEntry& entry) const {
+    assert(0 and "DerivativeNode doesn't implement record function.");
+}
+
+ptrDerivativeNode DerivativeNode::rebuild(const std::vector<ptrDerivativeNode>& operands) const {
+    assert(0 and "DerivativeNode doesn't implement rebuild function.");
+    return nullptr;
+}
+
+ptrDerivativeNode DerivativeNode::operandPartial(int k){
+    assert(0 and "DerivativeNode doesn't have operand.");
+    return nullptr;
+}
+
 
 ConstantDerivativeNode::ConstantDerivativeNode(double _a):a(_a){}
 
@@ -87,7 +255,7 @@ ptrDerivativeNode ConstantDerivativeNode::_diffPartial(int index){
     return ptrDerivativeNode(new ConstantDerivativeNode(0));
 }
 
-double ConstantDerivativeNode::call(const VectorXd& vec) const {
+double ConstantDerivativeNode::call(const DerivativeInput& vec) const {
     return a;
 }
 
@@ -107,7 +275,7 @@ ptrDerivativeNode VariableDerivativeNode::_diffPartial(int index){
     return ptrDerivativeNode(new ConstantDerivativeNode(index == ind));
 }
 
-double VariableDerivativeNode::call(const VectorXd& vec) const {
+double VariableDerivativeNode::call(const DerivativeInput& vec) const {
     return vec[ind];
 }
 
@@ -117,6 +285,25 @@ void VariableDerivativeNode::print(std::ostream& stream) const {
 }
 
 
+ParameterDerivativeNode::ParameterDerivativeNode(int _ind):ind(_ind){
+}
+
+ptrDerivativeNode ParameterDerivativeNode::_diffPartial(int index){
+    return ptrDerivativeNode(new ConstantDerivativeNode(0));
+}
+
+double ParameterDerivativeNode::call(const DerivativeInput& vec) const {
+    assert(0 and "Parameter is only evaluated by DerivativeTape.");
+    // NaN rather than a wrong value without assert
+    return std::numeric_limits<double>::quiet_NaN();
+}
+
+void ParameterDerivativeNode::print(std::ostream& stream) const {
+    stream << "p[" << ind << "]";
+    return;
+}
+
+
 LinearDerivativeNode::LinearDerivativeNode(VectorXd _v):v(_v){
 }
 
@@ -124,7 +311,7 @@ ptrDerivativeNode LinearDerivativeNode::_diffPartial(int index){
     return ptrDerivativeNode(new ConstantDerivativeNode(v[index]));
 }
 
-double LinearDerivativeNode::call(const VectorXd& vec) const {
+double LinearDerivativeNode::call(const DerivativeInput& vec) const {
     return v.transpose()*vec;
 }
 
@@ -132,7 +319,7 @@ double LinearDerivativeNode::call(const VectorXd& vec) const {
 DerivativeAddNode::DerivativeAddNode(const ptrDerivativeNode& _a, const ptrDerivativeNode& _b):a(_a), b(_b){
 }
 
-double DerivativeAddNode::call(const VectorXd& vec) const {
+double DerivativeAddNode::call(const DerivativeInput& vec) const {
     return a->call(vec) + b->call(vec);
 }
 
@@ -140,7 +327,7 @@ double DerivativeAddNode::call(const VectorXd& vec) const {
 DerivativeSubNode::DerivativeSubNode(const ptrDerivativeNode& _a, const ptrDerivativeNode& _b):a(_a), b(_b){
 }
 
-double DerivativeSubNode::call(const VectorXd& vec) const {
+double DerivativeSubNode::call(const DerivativeInput& vec) const {
     return a->call(vec) - b->call(vec);
 }
 
@@ -148,7 +335,7 @@ double DerivativeSubNode::call(const VectorXd& vec) const {
 DerivativeMultiplyNode::DerivativeMultiplyNode(const ptrDerivativeNode& _a, const ptrDerivativeNode& _b):a(_a), b(_b){
 }
 
-double DerivativeMultiplyNode::call(const VectorXd& vec) const {
+double DerivativeMultiplyNode::call(const DerivativeInput& vec) const {
     return a->call(vec) * b->call(vec);
 }
 
@@ -156,7 +343,7 @@ double DerivativeMultiplyNode::call(const VectorXd& vec) const {
 DerivativeDivideNode::DerivativeDivideNode(const ptrDerivativeNode& _a, const ptrDerivativeNode& _b):a(_a), b(_b){
 }
 
-double DerivativeDivideNode::call(const VectorXd& vec) const {
+double DerivativeDivideNode::call(const DerivativeInput& vec) const {
     return a->call(vec) / b->call(vec);
 }
 
@@ -164,7 +351,7 @@ double DerivativeDivideNode::call(const VectorXd& vec) const {
 DerivativePowNode::DerivativePowNode(const ptrDerivativeNode& _a, double _p):a(_a), p(_p){
 }
 
-double DerivativePowNode::call(const VectorXd& vec) const {
+double DerivativePowNode::call(const DerivativeInput& vec) const {
     return std::pow(a->call(vec), p);
 }
 
@@ -172,7 +359,7 @@ double DerivativePowNode::call(const VectorXd& vec) const {
 DerivativeExpNode::DerivativeExpNode(const ptrDerivativeNode& _a):a(_a){
 }
 
-double DerivativeExpNode::call(const VectorXd& vec) const {
+double DerivativeExpNode::call(const DerivativeInput& vec) const {
     return std::exp(a->call(vec));
 }
 
@@ -180,10 +367,73 @@ double DerivativeExpNode::call(const VectorXd& vec) const {
 DerivativeLogNode::DerivativeLogNode(const ptrDerivativeNode& _a):a(_a){
 }
 
-double DerivativeLogNode::call(const VectorXd& vec) const {
+double DerivativeLogNode::call(const DerivativeInput& vec) const {
     return std::log(a->call(vec));
 }
 
+DerivativeIntPowNode::DerivativeIntPowNode(const ptrDerivativeNode& _a, int _n):a(_a), n(_n){
+}
+
+double DerivativeIntPowNode::call(const DerivativeInput& vec) const {
+    return derivativeIntPow(a->call(vec), n);
+}
+
+DerivativeSinNode::DerivativeSinNode(const ptrDerivativeNode& _a):a(_a){
+}
+
+double DerivativeSinNode::call(const DerivativeInput& vec) const {
+    return std::sin(a->call(vec));
+}
+
+DerivativeCosNode::DerivativeCosNode(const ptrDerivativeNode& _a):a(_a){
+}
+
+double DerivativeCosNode::call(const DerivativeInput& vec) const {
+    return std::cos(a->call(vec));
+}
+
+DerivativeTanhNode::DerivativeTanhNode(const ptrDerivativeNode& _a):a(_a){
+}
+
+double DerivativeTanhNode::call(const DerivativeInput& vec) const {
+    return std::tanh(a->call(vec));
+}
+
+DerivativeSqrtNode::DerivativeSqrtNode(const ptrDerivativeNode& _a):a(_a){
+}
+
+double DerivativeSqrtNode::call(const DerivativeInput& vec) const {
+    return std::sqrt(a->call(vec));
+}
+
+DerivativeSigmoidNode::DerivativeSigmoidNode(const ptrDerivativeNode& _a):a(_a){
+}
+
+double DerivativeSigmoidNode::call(const DerivativeInput& vec) const {
+    return DerivativeScalarTraits<double>::sigmoid(a->call(vec));
+}
+
+DerivativeSoftplusNode::DerivativeSoftplusNode(const ptrDerivativeNode& _a):a(_a){
+}
+
+double DerivativeSoftplusNode::call(const DerivativeInput& vec) const {
+    return DerivativeScalarTraits<double>::softplus(a->call(vec));
+}
+
+DerivativeAbsNode::DerivativeAbsNode(const ptrDerivativeNode& _a):a(_a){
+}
+
+double DerivativeAbsNode::call(const DerivativeInput& vec) const {
+    return std::abs(a->call(vec));
+}
+
+DerivativeSignNode::DerivativeSignNode(const ptrDerivativeNode& _a):a(_a){
+}
+
+double DerivativeSignNode::call(const DerivativeInput& vec) const {
+    return DerivativeScalarTraits<double>::sign(a->call(vec));
+}
+
 
 Derivative::Derivative(ptrDerivativeNode _inst):inst(_inst){
 }
@@ -195,24 +445,926 @@ Derivative Derivative::Variable(int ind){
     return ptrDerivativeNode(new VariableDerivativeNode(ind));
 }
 
+Derivative Derivative::Parameter(int ind){
+    return ptrDerivativeNode(new ParameterDerivativeNode(ind));
+}
+
 Derivative Derivative::diffPartial(int index){
     // inst might be null
     assert(inst);
     return inst->diffPartial(index);
 }
 
-double Derivative::operator()(const VectorXd& vec) const {
+Derivative Derivative::diffPartial(std::vector<int> indices){
+    // inst might be null
+    assert(inst);
+    if(indices.empty())
+        return *this;
+
+    std::sort(indices.begin(), indices.end());
+    return inst->diffPartial(indices);
+}
+
+std::map<std::vector<int>, Derivative> Derivative::diffPartials(int order){
+    // inst might be null
+    assert(inst);
+    std::map<std::vector<int>, Derivative> ret;
+
+    // Extend sorted multi-index one by one, only with the variables the
+    // prefix partial differential still depends on.
+    std::function<void(std::vector<int>&, Derivative)> extend;
+    extend = [this, order, &ret, &extend](std::vector<int>& indices, Derivative prefix){
+        if((int)indices.size() == order){
+            ret[indices] = prefix;
+            return;
+        }
+
+        for(int ind : prefix.variables()){
+            if(not indices.empty() and ind < indices.back())
+                continue;
+
+            indices.push_back(ind);
+            Derivative d = diffPartial(indices);
+            if(not d.inst->isConstant(0))
+                extend(indices, d);
+            indices.pop_back();
+        }
+    };
+
+    std::vector<int> indices;
+    extend(indices, *this);
+    return ret;
+}
+
+std::vector<int> Derivative::variables() const {
+    // inst might be null
+    assert(inst);
+    std::set<int> ret;
+    std::unordered_set<const DerivativeNode*> visited;
+    std::vector<ptrDerivativeNode> stack(1, inst);
+
+    while(not stack.empty()){
+        ptrDerivativeNode node = stack.back();
+        stack.pop_back();
+        if(visited.count(node.get()))
+            continue;
+        visited.insert(node.get());
+
+        if(const DerivativeImplicitNode* implicit = dynamic_cast<const DerivativeImplicitNode*>(node.get())){
+            ret.insert(implicit->variables().begin(), implicit->variables().end());
+            continue;
+        }
+        if(const DerivativeBoundNode* bound = dynamic_cast<const DerivativeBoundNode*>(node.get())){
+            std::vector<int> vars = bound->variables();
+            ret.insert(vars.begin(), vars.end());
+            continue;
+        }
+        if(const DerivativeSumNode* sum = dynamic_cast<const DerivativeSumNode*>(node.get())){
+            for(int li = sum->begin;li < sum->end;li++)
+                for(int j : sum->offsets)
+                    ret.insert(li*sum->stride + j);
+            continue;
+        }
+
+        if(node->numOperands() == 0){
+            DerivativeTapeEntry entry;
+            node->record(entry);
+            if(entry.op == OpVariable)
+                ret.insert(entry.ind);
+            else if(entry.op == OpLinear)
+                for(int lx = 0;lx < entry.v.size();lx++)
+                    if(entry.v[lx] != 0)
+                        ret.insert(lx);
+        }
+
+        for(int lk = 0;lk < node->numOperands();lk++)
+            stack.push_back(node->operand(lk));
+    }
+
+    return std::vector<int>(ret.begin(), ret.end());
+}
+
+double Derivative::operator()(const DerivativeInput& vec) const {
     // inst might be null
     assert(inst);
     return inst->call(vec);
 }
 
+double Derivative::operator()(const double* x, int size, int stride) const {
+    return (*this)(Map<const VectorXd, 0, InnerStride<> >(x, size, InnerStride<>(stride)));
+}
+
+
+std::vector<Derivative> Derivative::gradientGraph(int x_size) const {
+    // inst might be null
+    assert(inst);
+
+    // Nodes in topological order by post-order DFS, same as DerivativeTape
+    std::vector<ptrDerivativeNode> order;
+    std::unordered_map<const DerivativeNode*, int> slot;
+    std::vector< std::pair<ptrDerivativeNode, int> > stack(1, std::make_pair(inst, 0));
+
+    while(not stack.empty()){
+        ptrDerivativeNode node = stack.back().first;
+        int k = stack.back().second;
+
+        if(k < node->numOperands()){
+            stack.back().second++;
+            ptrDerivativeNode child = node->operand(k);
+            if(not slot.count(child.get()))
+                stack.push_back(std::make_pair(child, 0));
+            continue;
+        }
+
+        stack.pop_back();
+        if(slot.count(node.get()))
+            continue;
+        slot[node.get()] = order.size();
+        order.push_back(node);
+    }
+
+    ptrDerivativeNode zero(new ConstantDerivativeNode(0));
+    std::vector<ptrDerivativeNode> adj(order.size(), zero), grad(x_size, zero);
+    adj.back() = ptrDerivativeNode(new ConstantDerivativeNode(1));
+
+    // Adjoint of every node is complete before it is visited
+    for(int lk = order.size()-1;lk >= 0;lk--){
+        const ptrDerivativeNode& node = order[lk];
+        if(adj[lk]->isConstant(0))
+            continue;
+
+        if(node->numOperands() == 0){
+            DerivativeTapeEntry entry;
+            node->record(entry);
+
+            if(entry.op == OpVariable){
+                assert(entry.ind < x_size);
+                grad[entry.ind] = newDerivativeAddNode(grad[entry.ind], adj[lk]);
+            }
+            else if(entry.op == OpLinear){
+                for(int lx = 0;lx < entry.v.size();lx++)
+                    if(entry.v[lx] != 0){
+                        assert(lx < x_size);
+                        grad[lx] = newDerivativeAddNode(
+                            grad[lx],
+                            newDerivativeMultiplyNode(
+                                adj[lk], ptrDerivativeNode(new ConstantDerivativeNode(entry.v[lx]))
+                            )
+                        );
+                    }
+            }
+            else if(entry.op != OpConstant and entry.op != OpParameter){
+                // Leaf without a tape op of its own, by its partial differential
+                for(int lx : Derivative(node).variables()){
+                    assert(lx < x_size);
+                    ptrDerivativeNode d = node->diffPartial(lx);
+                    if(not d->isConstant(0))
+                        grad[lx] = newDerivativeAddNode(grad[lx], newDerivativeMultiplyNode(adj[lk], d));
+                }
+            }
+            continue;
+        }
+
+        for(int la = 0;la < node->numOperands();la++){
+            int child = slot[node->operand(la).get()];
+            adj[child] = newDerivativeAddNode(
+                adj[child],
+                newDerivativeMultiplyNode(adj[lk], node->operandPartial(la))
+            );
+        }
+    }
+
+    // The gradient doesn't contain the root, as operandPartial never returns
+    // the node itself, so saving it in the root's dp_map makes no cycle.
+    std::vector<Derivative> ret;
+    for(int lx = 0;lx < x_size;lx++){
+        if(not inst->dp_map.count(lx))
+            inst->dp_map[lx] = grad[lx];
+        ret.push_back(Derivative(grad[lx]));
+    }
+    return ret;
+}
+
+VectorXd Derivative::hessianVectorProduct(const DerivativeInput& x, const DerivativeInput& v) const {
+    DerivativeTape tape(std::vector<Derivative>(1, *this));
+    DerivativeWorkspace ws;
+    VectorXd Hv(x.size());
+    tape.hessianVectorProduct(x, VectorXd::Ones(1), v, Hv, ws);
+    return Hv;
+}
+
+Derivative Derivative::bind(const std::map<int, double>& values, bool renumber) const {
+    return Eigen::bind(std::vector<Derivative>(1, *this), values, renumber)[0];
+}
+
+
+namespace{
+
+// Rebuild the graphs with leaf(node, entry) in place of each leaf, and fold
+// the subtrees which become constant. The subtrees the roots share stay
+// shared.
+std::vector<Derivative> rebuildGraph(
+    const std::vector<Derivative>& roots,
+    const std::function<ptrDerivativeNode(const ptrDerivativeNode&, const DerivativeTapeEntry&)>& leaf
+){
+    // New node of each visited node
+    std::unordered_map<const DerivativeNode*, ptrDerivativeNode> bound;
+
+    // Post-order DFS without recursion, same as DerivativeTape
+    std::vector< std::pair<ptrDerivativeNode, int> > stack;
+    std::vector<Derivative> ret;
+
+    for(const Derivative& root : roots){
+        // inst might be null
+        assert(root.inst);
+        if(not bound.count(root.inst.get()))
+            stack.push_back(std::make_pair(root.inst, 0));
+
+        while(not stack.empty()){
+            ptrDerivativeNode node = stack.back().first;
+            int k = stack.back().second;
+
+            if(k < node->numOperands()){
+                stack.back().second++;
+                ptrDerivativeNode child = node->operand(k);
+                if(not bound.count(child.get()))
+                    stack.push_back(std::make_pair(child, 0));
+                continue;
+            }
+
+            stack.pop_back();
+            if(bound.count(node.get()))
+                continue;
+
+            ptrDerivativeNode result = node;
+            if(node->numOperands() == 0){
+                DerivativeTapeEntry entry;
+                node->record(entry);
+                result = leaf(node, entry);
+            }
+            else{
+                std::vector<ptrDerivativeNode> operands;
+                bool changed = false, folded = true;
+                for(int lk = 0;lk < node->numOperands();lk++){
+                    ptrDerivativeNode child = node->operand(lk);
+                    operands.push_back(bound[child.get()]);
+                    changed = changed or operands.back() != child;
+
+                    DerivativeTapeEntry entry;
+                    operands.back()->record(entry);
+                    folded = folded and entry.op == OpConstant;
+                }
+
+                // Keep the node which doesn't change, with its saved
+                // partial differential
+                if(folded)
+                    result = ptrDerivativeNode(new ConstantDerivativeNode(node->rebuild(operands)->call(VectorXd())));
+                else if(changed)
+                    result = node->rebuild(operands);
+            }
+
+            bound[node.get()] = result;
+        }
+
+        ret.push_back(Derivative(bound[root.inst.get()]));
+    }
+
+    return ret;
+}
+
+// x[i] in the graph becomes x[i + offset], offset can be negative if no
+// variable goes below 0
+ptrDerivativeNode shiftVariables(const ptrDerivativeNode& node, int offset){
+    if(offset == 0)
+        return node;
+
+    auto leaf = [offset](const ptrDerivativeNode& node, const DerivativeTapeEntry& entry){
+        if(entry.op == OpVariable){
+            assert(entry.ind + offset >= 0);
+            return ptrDerivativeNode(new VariableDerivativeNode(entry.ind + offset));
+        }
+        if(entry.op == OpLinear){
+            VectorXd v = VectorXd::Zero(std::max<int>(entry.v.size() + offset, 0));
+            for(int lx = 0;lx < entry.v.size();lx++)
+                if(entry.v[lx] != 0){
+                    assert(lx + offset >= 0);
+                    v[lx + offset] = entry.v[lx];
+                }
+            return ptrDerivativeNode(new LinearDerivativeNode(v));
+        }
+        if(entry.op == OpSum)
+            return static_cast<const DerivativeSumNode*>(node.get())->shifted(offset);
+        return node;
+    };
+
+    return rebuildGraph(std::vector<Derivative>(1, Derivative(node)), leaf)[0].inst;
+}
+
+} // namespace
+
+
+DerivativeSumNode::DerivativeSumNode(const ptrDerivativeNode& _term, int _begin, int _end, int _stride, std::shared_ptr<const DerivativeTape> _tape):
+    term(_term), begin(_begin), end(_end), stride(_stride), tape(_tape){
+    assert(begin < end and begin >= 0 and stride > 0);
+    if(not tape)
+        tape = std::make_shared<DerivativeTape>(std::vector<Derivative>(1, Derivative(term)));
+    offsets = Derivative(term).variables();
+}
+
+ptrDerivativeNode DerivativeSumNode::_diffPartial(int index){
+    // x[index] is offset j of the term of i = (index - j)/stride
+    ptrDerivativeNode ret(new ConstantDerivativeNode(0));
+    for(int j : offsets){
+        if(index < j or (index - j) % stride)
+            continue;
+        int li = (index - j)/stride;
+        if(li < begin or li >= end)
+            continue;
+
+        if(not partial_tape.count(j))
+            partial_tape[j] = std::make_shared<DerivativeTape>(
+                std::vector<Derivative>(1, Derivative(term->diffPartial(j)))
+            );
+
+        ret = newDerivativeAddNode(
+            ret, newDerivativeSumNode(term->diffPartial(j), li, li + 1, stride, partial_tape[j])
+        );
+    }
+    return ret;
+}
+
+double DerivativeSumNode::call(const DerivativeInput& vec) const {
+    // One workspace for each thread rather than in the node, so a graph is
+    // still safe to evaluate from several threads. Evaluating the term never
+    // comes back to call, the tape loops the sums inside it.
+    static thread_local DerivativeWorkspace ws;
+    int width = tape->numVariables();
+
+    double ret = 0, value;
+    for(int li = begin;li < end;li++){
+        tape->evaluate(vec.segment(li*stride, width), Map<VectorXd>(&value, 1), ws);
+        ret += value;
+    }
+    return ret;
+}
+
+void DerivativeSumNode::print(std::ostream& stream) const {
+    stream << "Sum[i=" << begin << ":" << end;
+    if(stride != 1)
+        stream << ", stride " << stride;
+    stream << "](";
+    term->print(stream);
+    stream << ")";
+    return;
+}
+
+void DerivativeSumNode::record(DerivativeTapeEntry& entry) const {
+    entry.op = OpSum;
+    entry.term = tape;
+    entry.ind = begin;
+    entry.end = end;
+    entry.stride = stride;
+}
+
+ptrDerivativeNode DerivativeSumNode::shifted(int offset) const {
+    // x[i*stride + j + offset] is x[(i + q)*stride + j + r], with the
+    // smallest q which keeps begin + q >= 0
+    int q = offset/stride - (offset % stride < 0), r = offset - q*stride;
+    while(begin + q < 0)
+        q++, r -= stride;
+    if(r == 0)
+        return newDerivativeSumNode(term, begin + q, end + q, stride, tape);
+    return newDerivativeSumNode(shiftVariables(term, r), begin + q, end + q, stride);
+}
+
+
+DerivativePolynomialNode::DerivativePolynomialNode(const std::vector<int>& _vars, const Matrix<int, Dynamic, Dynamic, RowMajor>& _exps, const VectorXd& _coef):
+    vars(_vars), exps(_exps), coef(_coef){
+    assert(std::is_sorted(vars.begin(), vars.end()));
+    assert(exps.rows() == coef.size() and exps.cols() == (int)vars.size());
+    power_begin.push_back(0);
+    for(int lv = 0;lv < exps.cols();lv++)
+        power_begin.push_back(power_begin.back() + exps.col(lv).maxCoeff() + 1);
+}
+
+double DerivativePolynomialNode::horner(const double* power, int lo, int hi, int v) const {
+    if(v == exps.cols())
+        return coef[lo];
+
+    // Terms lo to hi-1 have the same exponents before v, and descending
+    // exponent of v. With P_d their sum of x**d:
+    //   (..(P_d1 * x**(d1 - d2) + P_d2) * x**(d2 - d3) ..) * x**dn
+    const double* p = power + power_begin[v];
+    double ret = 0;
+    int last = exps(lo, v);
+    for(int lt = lo;lt < hi;){
+        int d = exps(lt, v), next = lt;
+        while(next < hi and exps(next, v) == d)
+            next++;
+        ret = ret*p[last - d] + horner(power, lt, next, v + 1);
+        last = d;
+        lt = next;
+    }
+    return ret*p[last];
+}
+
+ptrDerivativeNode DerivativePolynomialNode::hornerNode(const std::vector<std::vector<ptrDerivativeNode> >& power, int lo, int hi, int v) const {
+    if(v == exps.cols())
+        return ptrDerivativeNode(new ConstantDerivativeNode(coef[lo]));
+
+    // The same as horner
+    ptrDerivativeNode ret;
+    int last = exps(lo, v);
+    for(int lt = lo;lt < hi;){
+        int d = exps(lt, v), next = lt;
+        while(next < hi and exps(next, v) == d)
+            next++;
+        ptrDerivativeNode rest = hornerNode(power, lt, next, v + 1);
+        ret = ret ? newDerivativeAddNode(newDerivativeMultiplyNode(ret, power[v][last - d]), rest) : rest;
+        last = d;
+        lt = next;
+    }
+    return newDerivativeMultiplyNode(ret, power[v][last]);
+}
+
+ptrDerivativeNode DerivativePolynomialNode::hornerForm() const {
+    if(not horner_form){
+        // One node for each power, shared by the terms
+        std::vector<std::vector<ptrDerivativeNode> > power(vars.size());
+        for(int lv = 0;lv < (int)vars.size();lv++){
+            ptrDerivativeNode x(new VariableDerivativeNode(vars[lv]));
+            for(int lk = 0;lk < power_begin[lv + 1] - power_begin[lv];lk++)
+                power[lv].push_back(newDerivativeIntPowNode(x, lk));
+        }
+        horner_form = hornerNode(power, 0, exps.rows(), 0);
+    }
+    return horner_form;
+}
+
+ptrDerivativeNode DerivativePolynomialNode::_diffPartial(int index){
+    int v = std::lower_bound(vars.begin(), vars.end(), index) - vars.begin();
+    if(v == (int)vars.size() or vars[v] != index)
+        return ptrDerivativeNode(new ConstantDerivativeNode(0));
+
+    std::vector<int> rows;
+    for(int lt = 0;lt < exps.rows();lt++)
+        if(exps(lt, v) > 0)
+            rows.push_back(lt);
+
+    Matrix<int, Dynamic, Dynamic, RowMajor> d_exps(rows.size(), exps.cols());
+    VectorXd d_coef(rows.size());
+    for(int lt = 0;lt < (int)rows.size();lt++){
+        d_exps.row(lt) = exps.row(rows[lt]);
+        d_exps(lt, v)--;
+        d_coef[lt] = coef[rows[lt]]*exps(rows[lt], v);
+    }
+    return newDerivativePolynomialNode(vars, d_exps, d_coef);
+}
+
+double DerivativePolynomialNode::call(const DerivativeInput& vec) const {
+    // x[vars[v]]**k for k up to the degree of each variable. One table for
+    // each thread, grown to the largest polynomial evaluated on it, so call
+    // doesn't allocate.
+    static thread_local std::vector<double> power;
+    if((int)power.size() < power_begin.back())
+        power.resize(power_begin.back());
+    for(int lv = 0;lv < (int)vars.size();lv++){
+        double* p = power.data() + power_begin[lv];
+        p[0] = 1;
+        for(int lk = power_begin[lv] + 1;lk < power_begin[lv + 1];lk++, p++)
+            p[1] = p[0]*vec[vars[lv]];
+    }
+    return horner(power.data(), 0, exps.rows(), 0);
+}
+
+void DerivativePolynomialNode::print(std::ostream& stream) const {
+    stream << "Poly(";
+    for(int lt = 0;lt < exps.rows();lt++){
+        double c = coef[lt];
+        if(lt > 0){
+            stream << (c < 0 ? " - " : " + ");
+            c = std::abs(c);
+        }
+
+        bool constant = exps.row(lt).isZero();
+        if(constant or std::abs(c) != 1)
+            stream << c;
+        else if(c < 0)
+            stream << "-";
+
+        bool first = constant or std::abs(c) == 1;
+        for(int lv = 0;lv < exps.cols();lv++){
+            if(exps(lt, lv) == 0)
+                continue;
+            if(not first)
+                stream << "*";
+            first = false;
+            stream << "x[" << vars[lv] << "]";
+            if(exps(lt, lv) > 1)
+                stream << "**" << exps(lt, lv);
+        }
+    }
+    stream << ")";
+    return;
+}
+
+// The rest see the Horner form
+void DerivativePolynomialNode::printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const {
+    hornerForm()->printNode(stream, printOperand);
+}
+
+int DerivativePolynomialNode::numOperands() const { return hornerForm()->numOperands(); }
+
+ptrDerivativeNode DerivativePolynomialNode::operand(int k) const { return hornerForm()->operand(k); }
+
+void DerivativePolynomialNode::record(DerivativeTapeEntry& entry) const { hornerForm()->record(entry); }
+
+ptrDerivativeNode DerivativePolynomialNode::rebuild(const std::vector<ptrDerivativeNode>& operands) const {
+    return hornerForm()->rebuild(operands);
+}
+
+ptrDerivativeNode DerivativePolynomialNode::operandPartial(int k){
+    return hornerForm()->operandPartial(k);
+}
+
+
+namespace{
+
+// Polynomial by its terms, a term is keyed by the sorted pairs of variable
+// and exponent
+typedef std::vector<std::pair<int, int> > Monomial;
+typedef std::map<Monomial, double> Polynomial;
+
+// a + scale*b
+Polynomial addPolynomial(Polynomial a, const Polynomial& b, double scale){
+    for(const auto& term : b){
+        double& c = a[term.first];
+        c += scale*term.second;
+        if(c == 0)
+            a.erase(term.first);
+    }
+    return a;
+}
+
+Polynomial multiplyPolynomial(const Polynomial& a, const Polynomial& b){
+    Polynomial ret;
+    for(const auto& ta : a)
+        for(const auto& tb : b){
+            // Merge the sorted pairs
+            Monomial m;
+            auto lx = ta.first.begin(), ly = tb.first.begin();
+            while(lx != ta.first.end() or ly != tb.first.end()){
+                if(ly == tb.first.end() or (lx != ta.first.end() and lx->first < ly->first))
+                    m.push_back(*lx++);
+                else if(lx == ta.first.end() or ly->first < lx->first)
+                    m.push_back(*ly++);
+                else{
+                    m.push_back(std::make_pair(lx->first, lx->second + ly->second));
+                    lx++, ly++;
+                }
+            }
+            ret[m] += ta.second*tb.second;
+        }
+
+    for(auto it = ret.begin();it != ret.end();)
+        if(it->second == 0)
+            it = ret.erase(it);
+        else
+            it++;
+    return ret;
+}
+
+ptrDerivativeNode polynomialNode(const Polynomial& poly){
+    std::set<int> var_set;
+    for(const auto& term : poly)
+        for(const auto& ve : term.first)
+            var_set.insert(ve.first);
+    std::vector<int> vars(var_set.begin(), var_set.end());
+
+    Matrix<int, Dynamic, Dynamic, RowMajor> exps = Matrix<int, Dynamic, Dynamic, RowMajor>::Zero(poly.size(), vars.size());
+    VectorXd coef(poly.size());
+    int lt = 0;
+    for(const auto& term : poly){
+        for(const auto& ve : term.first)
+            exps(lt, std::lower_bound(vars.begin(), vars.end(), ve.first) - vars.begin()) = ve.second;
+        coef[lt++] = term.second;
+    }
+    return newDerivativePolynomialNode(vars, exps, coef);
+}
+
+} // namespace
+
+Derivative Derivative::polynomial(int max_terms) const {
+    // inst might be null
+    assert(inst);
+
+    // Polynomial of the visited nodes which are, and the new node of the
+    // others. The new node of a polynomial is made when asked for, so only
+    // the largest polynomial subgraphs become nodes.
+    std::unordered_map<const DerivativeNode*, Polynomial> poly;
+    std::unordered_map<const DerivativeNode*, ptrDerivativeNode> converted;
+
+    auto convert = [&](const ptrDerivativeNode& node) -> ptrDerivativeNode {
+        auto it = converted.find(node.get());
+        if(it != converted.end())
+            return it->second;
+        return converted[node.get()] = node->numOperands() == 0 ? node : polynomialNode(poly[node.get()]);
+    };
+
+    // Post-order DFS without recursion, same as DerivativeTape
+    std::vector< std::pair<ptrDerivativeNode, int> > stack(1, std::make_pair(inst, 0));
+    while(not stack.empty()){
+        ptrDerivativeNode node = stack.back().first;
+        int k = stack.back().second;
+        if(poly.count(node.get()) or converted.count(node.get())){
+            stack.pop_back();
+            continue;
+        }
+
+        // Don't go into the expansion of the nodes which have their own
+        if(k == 0){
+            if(DerivativePolynomialNode* p = dynamic_cast<DerivativePolynomialNode*>(node.get())){
+                Polynomial& q = poly[node.get()];
+                for(int lt = 0;lt < p->exps.rows();lt++){
+                    Monomial m;
+                    for(int lv = 0;lv < p->exps.cols();lv++)
+                        if(p->exps(lt, lv))
+                            m.push_back(std::make_pair(p->vars[lv], p->exps(lt, lv)));
+                    q[m] = p->coef[lt];
+                }
+                converted[node.get()] = node;
+                stack.pop_back();
+                continue;
+            }
+            if(DerivativeSumNode* p = dynamic_cast<DerivativeSumNode*>(node.get())){
+                ptrDerivativeNode term = Derivative(p->term).polynomial(max_terms).inst;
+                converted[node.get()] = term == p->term ? node : newDerivativeSumNode(term, p->begin, p->end, p->stride);
+                stack.pop_back();
+                continue;
+            }
+        }
+
+        if(k < node->numOperands()){
+            stack.back().second++;
+            stack.push_back(std::make_pair(node->operand(k), 0));
+            continue;
+        }
+        stack.pop_back();
+
+        DerivativeTapeEntry entry;
+        node->record(entry);
+        Polynomial p;
+        bool is_poly = true;
+        for(int lk = 0;lk < node->numOperands();lk++)
+            is_poly = is_poly and poly.count(node->operand(lk).get());
+
+        if(node->numOperands() == 0){
+            if(entry.op == OpConstant){
+                if(entry.p != 0)
+                    p[Monomial()] = entry.p;
+            }
+            else if(entry.op == OpVariable)
+                p[Monomial(1, std::make_pair(entry.ind, 1))] = 1;
+            else if(entry.op == OpLinear){
+                for(int lx = 0;lx < entry.v.size();lx++)
+                    if(entry.v[lx] != 0)
+                        p[Monomial(1, std::make_pair(lx, 1))] = entry.v[lx];
+            }
+            else
+                is_poly = false;
+        }
+        else if(is_poly){
+            const Polynomial& a = poly[node->operand(0).get()];
+            const Polynomial& b = poly[node->operand(node->numOperands() - 1).get()];
+            if(entry.op == OpAdd)
+                p = addPolynomial(a, b, 1);
+            else if(entry.op == OpSub)
+                p = addPolynomial(a, b, -1);
+            else if(entry.op == OpMultiply)
+                p = multiplyPolynomial(a, b);
+            else if(entry.op == OpDivide and b.size() == 1 and b.begin()->first.empty())
+                p = addPolynomial(Polynomial(), a, 1/b.begin()->second);
+            else if(entry.op == OpIntPow and entry.ind >= 0){
+                p[Monomial()] = 1;
+                for(int lk = 0;lk < entry.ind and (int)p.size() <= max_terms;lk++)
+                    p = multiplyPolynomial(p, a);
+            }
+            else
+                is_poly = false;
+        }
+
+        if(is_poly and (int)p.size() <= max_terms)
+            poly[node.get()] = p;
+        else if(node->numOperands() == 0)
+            converted[node.get()] = node;
+        else{
+            std::vector<ptrDerivativeNode> operands;
+            bool changed = false;
+            for(int lk = 0;lk < node->numOperands();lk++){
+                operands.push_back(convert(node->operand(lk)));
+                changed = changed or operands.back() != node->operand(lk);
+            }
+            converted[node.get()] = changed ? node->rebuild(operands) : node;
+        }
+    }
+
+    return Derivative(convert(inst));
+}
+
+
+std::vector<Derivative> bind(const std::vector<Derivative>& roots, const std::map<int, double>& values, bool renumber){
+    // New index of variable, moved down over the bound ones
+    auto newIndex = [&](int ind){
+        if(not renumber)
+            return ind;
+        return ind - (int)std::distance(values.begin(), values.lower_bound(ind));
+    };
+
+    auto constant = [](double c){
+        return ptrDerivativeNode(new ConstantDerivativeNode(c));
+    };
+
+    auto leaf = [&](const ptrDerivativeNode& node, const DerivativeTapeEntry& entry){
+        if(entry.op == OpVariable){
+            if(values.count(entry.ind))
+                return constant(values.at(entry.ind));
+            if(newIndex(entry.ind) != entry.ind)
+                return ptrDerivativeNode(new VariableDerivativeNode(newIndex(entry.ind)));
+        }
+        else if(entry.op == OpLinear){
+            // Split into the constant of bound part and the rest
+            double c = 0;
+            int n = entry.v.size();
+            VectorXd v = VectorXd::Zero(newIndex(n));
+            for(int lx = 0;lx < n;lx++){
+                if(values.count(lx))
+                    c += entry.v[lx]*values.at(lx);
+                else
+                    v[newIndex(lx)] = entry.v[lx];
+            }
+
+            if(not v.isZero(0))
+                return newDerivativeAddNode(ptrDerivativeNode(new LinearDerivativeNode(v)), constant(c));
+            return constant(c);
+        }
+        else if(entry.op == OpSum){
+            // Each run of the terms whose variables are not bound and move
+            // by the same offset stays a sum. The other terms are bound one
+            // by one.
+            const DerivativeSumNode* sum = static_cast<const DerivativeSumNode*>(node.get());
+            int stride = sum->stride, first = sum->begin, run_moved = 0;
+            ptrDerivativeNode ret = constant(0);
+
+            auto run = [&](int last){
+                if(first < last)
+                    ret = newDerivativeAddNode(ret, DerivativeSumNode(sum->term, first, last, stride, sum->tape).shifted(run_moved));
+            };
+
+            for(int li = sum->begin;li < sum->end;li++){
+                bool plain = true;
+                int moved = 0;
+                for(int lj = 0;lj < (int)sum->offsets.size() and plain;lj++){
+                    int lx = li*stride + sum->offsets[lj];
+                    plain = not values.count(lx) and (lj == 0 or newIndex(lx) - lx == moved);
+                    moved = newIndex(lx) - lx;
+                }
+
+                if(plain and li > first and moved == run_moved)
+                    continue;
+                run(li);
+                first = li;
+                run_moved = moved;
+                if(not plain){
+                    ptrDerivativeNode term = shiftVariables(sum->term, li*stride);
+                    ret = newDerivativeAddNode(ret, Eigen::bind(std::vector<Derivative>(1, Derivative(term)), values, renumber)[0].inst);
+                    first = li + 1;
+                }
+            }
+            run(sum->end);
+
+            // The whole sum in one run, unmoved
+            if(ret->numOperands() == 0 and run_moved == 0 and first == sum->begin)
+                return node;
+            return ret;
+        }
+        else if(entry.op == OpOpaque){
+            // Evaluated at the bound values through a DerivativeBoundNode
+            std::vector<int> vars = Derivative(node).variables();
+            int width = vars.empty() ? 0 : vars.back() + 1;
+            std::vector<int> source(width, -1);
+            VectorXd value = VectorXd::Zero(width);
+            bool changed = false;
+            for(int lx : vars){
+                if(values.count(lx))
+                    value[lx] = values.at(lx);
+                else
+                    source[lx] = newIndex(lx);
+                changed = changed or source[lx] != lx;
+            }
+
+            if(changed)
+                return ptrDerivativeNode(new DerivativeBoundNode(node, source, value));
+        }
+        return node;
+    };
+
+    return rebuildGraph(roots, leaf);
+}
+
 
 std::ostream& operator<< (std::ostream& stream, const Derivative& a){
     a.inst->print(stream);
     return stream;
 }
 
+void Derivative::printShared(std::ostream& stream) const {
+    // inst might be null
+    assert(inst);
+
+    // Nodes in topological order, and the number of parents of each
+    std::vector<const DerivativeNode*> order;
+    std::unordered_map<const DerivativeNode*, int> parents;
+    std::vector< std::pair<const DerivativeNode*, int> > stack(1, std::make_pair(inst.get(), 0));
+    parents[inst.get()] = 0;
+
+    while(not stack.empty()){
+        const DerivativeNode* node = stack.back().first;
+        int k = stack.back().second;
+
+        if(k < node->numOperands()){
+            stack.back().second++;
+            const DerivativeNode* child = node->operand(k).get();
+            if(not parents.count(child)){
+                parents[child] = 0;
+                stack.push_back(std::make_pair(child, 0));
+            }
+            parents[child]++;
+            continue;
+        }
+
+        stack.pop_back();
+        order.push_back(node);
+    }
+
+    // Shared node with operands is printed once by name
+    std::unordered_map<const DerivativeNode*, int> name;
+    for(const DerivativeNode* node : order)
+        if(node->numOperands() and parents[node] > 1){
+            int id = name.size() + 1;
+            name[node] = id;
+        }
+
+    // Stop as soon as the stream fails, e.g. reaching the limit of toString
+    std::function<void(const DerivativeNode*, bool)> emit = [&](const DerivativeNode* node, bool define){
+        if(not stream)
+            return;
+        if(not define and name.count(node))
+            stream << "t" << name[node];
+        else if(node->numOperands() == 0)
+            node->print(stream);
+        else
+            node->printNode(stream, [&](int k){ emit(node->operand(k).get(), false); });
+    };
+
+    for(const DerivativeNode* node : order)
+        if(name.count(node) and stream){
+            stream << "t" << name[node] << " = ";
+            emit(node, true);
+            stream << ";" << std::endl;
+        }
+    emit(inst.get(), false);
+}
+
+namespace{
+
+// Buffer of at most limit characters, further output fails the stream
+class LimitedBuffer : public std::streambuf{
+public:
+    std::string str;
+    size_t limit;
+
+    LimitedBuffer(size_t _limit):limit(_limit){}
+
+    int overflow(int c){
+        if(c == traits_type::eof() or str.size() >= limit)
+            return traits_type::eof();
+        str.push_back(c);
+        return c;
+    }
+};
+
+} // namespace
+
+std::string Derivative::toString(size_t max_size) const {
+    LimitedBuffer buffer(max_size);
+    std::ostream stream(&buffer);
+    printShared(stream);
+
+    if(not stream)
+        buffer.str += "...";
+    return buffer.str;
+}
+
 
 void LinearDerivativeNode::print(std::ostream& stream) const {
     // TODO(Mudream): output more simple formula
@@ -226,59 +1378,122 @@ void LinearDerivativeNode::print(std::ostream& stream) const {
     return;
 }
 
-void DerivativeAddNode::print(std::ostream& stream) const {
+void DerivativeAddNode::printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const {
     stream << "("; 
-    a->print(stream);
+    printOperand(0);
     stream << " + ";
-    b->print(stream);
+    printOperand(1);
     stream << ")"; 
     return;
 }
 
-void DerivativeSubNode::print(std::ostream& stream) const {
+void DerivativeSubNode::printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const {
     stream << "("; 
-    a->print(stream);
+    printOperand(0);
     stream << " - ";
-    b->print(stream);
+    printOperand(1);
     stream << ")"; 
     return;
 }
 
-void DerivativeMultiplyNode::print(std::ostream& stream) const {
+void DerivativeMultiplyNode::printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const {
     stream << "("; 
-    a->print(stream);
+    printOperand(0);
     stream << " * ";
-    b->print(stream);
+    printOperand(1);
     stream << ")"; 
     return;
 }
 
-void DerivativeDivideNode::print(std::ostream& stream) const {
+void DerivativeDivideNode::printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const {
     stream << "("; 
-    a->print(stream);
+    printOperand(0);
     stream << " / ";
-    b->print(stream);
+    printOperand(1);
     stream << ")"; 
     return;
 }
 
-void DerivativePowNode::print(std::ostream& stream) const {
+void DerivativePowNode::printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const {
     stream << "("; 
-    a->print(stream);
+    printOperand(0);
     stream << "**" << p << ")";
     return;
 }
 
-void DerivativeExpNode::print(std::ostream& stream) const {
+void DerivativeExpNode::printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const {
     stream << "Exp("; 
-    a->print(stream);
+    printOperand(0);
     stream << ")"; 
     return;
 }
 
-void DerivativeLogNode::print(std::ostream& stream) const {
+void DerivativeLogNode::printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const {
     stream << "Log("; 
-    a->print(stream);
+    printOperand(0);
+    stream << ")"; 
+    return;
+}
+
+void DerivativeIntPowNode::printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const {
+    stream << "("; 
+    printOperand(0);
+    stream << "**" << n << ")"; 
+    return;
+}
+
+void DerivativeSinNode::printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const {
+    stream << "Sin("; 
+    printOperand(0);
+    stream << ")"; 
+    return;
+}
+
+void DerivativeCosNode::printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const {
+    stream << "Cos("; 
+    printOperand(0);
+    stream << ")"; 
+    return;
+}
+
+void DerivativeTanhNode::printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const {
+    stream << "Tanh("; 
+    printOperand(0);
+    stream << ")"; 
+    return;
+}
+
+void DerivativeSqrtNode::printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const {
+    stream << "Sqrt("; 
+    printOperand(0);
+    stream << ")"; 
+    return;
+}
+
+void DerivativeSigmoidNode::printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const {
+    stream << "Sigmoid("; 
+    printOperand(0);
+    stream << ")"; 
+    return;
+}
+
+void DerivativeSoftplusNode::printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const {
+    stream << "Softplus("; 
+    printOperand(0);
+    stream << ")"; 
+    return;
+}
+
+void DerivativeAbsNode::printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const {
+    stream << "Abs("; 
+    printOperand(0);
+    stream << ")"; 
+    return;
+}
+
+void DerivativeSignNode::printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const {
+    stream << "Sign("; 
+    printOperand(0);
     stream << ")"; 
     return;
 }
@@ -317,15 +1532,18 @@ ptrDerivativeNode DerivativeDivideNode::_diffPartial(int index){
 
 ptrDerivativeNode DerivativePowNode::_diffPartial(int index){
     return newDerivativeMultiplyNode(
-        ptrDerivativeNode(new ConstantDerivativeNode(p)),
-        newDerivativePowNode(a, p-1)
+        a->diffPartial(index),
+        newDerivativeMultiplyNode(
+            ptrDerivativeNode(new ConstantDerivativeNode(p)),
+            newDerivativePowNode(a, p-1)
+        )
     );
 }
 
 ptrDerivativeNode DerivativeExpNode::_diffPartial(int index){
     return newDerivativeMultiplyNode(
         a->diffPartial(index),
-        newDerivativeExpNode(a)
+        operandPartial(0)
     );
 }
 
@@ -335,35 +1553,2054 @@ ptrDerivativeNode DerivativeLogNode::_diffPartial(int index){
     );
 }
 
+ptrDerivativeNode DerivativeIntPowNode::_diffPartial(int index){
+    return newDerivativeMultiplyNode(
+        a->diffPartial(index),
+        newDerivativeMultiplyNode(
+            ptrDerivativeNode(new ConstantDerivativeNode(n)),
+            newDerivativeIntPowNode(a, n-1)
+        )
+    );
+}
 
-// Operator on Wrapper
+ptrDerivativeNode DerivativeSinNode::_diffPartial(int index){
+    ptrDerivativeNode ad = a->diffPartial(index);
+    if(ad->isConstant(0)) return ad;
+    return newDerivativeMultiplyNode(ad, operandPartial(0));
+}
 
-Derivative operator+(const Derivative& a, const Derivative& b){
-    return newDerivativeAddNode(a.inst, b.inst);
+ptrDerivativeNode DerivativeCosNode::_diffPartial(int index){
+    ptrDerivativeNode ad = a->diffPartial(index);
+    if(ad->isConstant(0)) return ad;
+    return newDerivativeMultiplyNode(ad, operandPartial(0));
 }
 
-Derivative operator-(const Derivative& a, const Derivative& b){
-    return newDerivativeSubNode(a.inst, b.inst);
+ptrDerivativeNode DerivativeTanhNode::_diffPartial(int index){
+    return newDerivativeMultiplyNode(
+        a->diffPartial(index),
+        operandPartial(0)
+    );
 }
 
-Derivative operator*(const Derivative& a, const Derivative& b){
-    return newDerivativeMultiplyNode(a.inst, b.inst);
+ptrDerivativeNode DerivativeSqrtNode::_diffPartial(int index){
+    return newDerivativeMultiplyNode(
+        a->diffPartial(index),
+        operandPartial(0)
+    );
 }
 
-Derivative operator/(const Derivative& a, const Derivative& b){
-    return newDerivativeDivideNode(a.inst, b.inst);
+ptrDerivativeNode DerivativeSigmoidNode::_diffPartial(int index){
+    return newDerivativeMultiplyNode(
+        a->diffPartial(index),
+        operandPartial(0)
+    );
 }
 
-Derivative pow(const Derivative& a, double p){
-    return newDerivativePowNode(a.inst, p);
+ptrDerivativeNode DerivativeSoftplusNode::_diffPartial(int index){
+    ptrDerivativeNode ad = a->diffPartial(index);
+    if(ad->isConstant(0)) return ad;
+    return newDerivativeMultiplyNode(ad, operandPartial(0));
 }
 
-Derivative exp(const Derivative& a){
-    return newDerivativeExpNode(a.inst);
+ptrDerivativeNode DerivativeAbsNode::_diffPartial(int index){
+    return newDerivativeMultiplyNode(
+        a->diffPartial(index),
+        newDerivativeSignNode(a)
+    );
 }
 
-Derivative log(const Derivative& a){
-    return newDerivativeLogNode(a.inst);
+ptrDerivativeNode DerivativeSignNode::_diffPartial(int index){
+    return ptrDerivativeNode(new ConstantDerivativeNode(0));
+}
+
+
+// Partial differential with respect to operand
+
+ptrDerivativeNode DerivativeAddNode::operandPartial(int k){
+    return ptrDerivativeNode(new ConstantDerivativeNode(1));
+}
+
+ptrDerivativeNode DerivativeSubNode::operandPartial(int k){
+    return ptrDerivativeNode(new ConstantDerivativeNode(k ? -1 : 1));
+}
+
+ptrDerivativeNode DerivativeMultiplyNode::operandPartial(int k){
+    return k ? a : b;
+}
+
+ptrDerivativeNode DerivativeDivideNode::operandPartial(int k){
+    ptrDerivativeNode one(new ConstantDerivativeNode(1));
+    if(k == 0)
+        return newDerivativeDivideNode(one, b);
+
+    // -a/(b*b)
+    return newDerivativeDivideNode(
+        newDerivativeMultiplyNode(
+            ptrDerivativeNode(new ConstantDerivativeNode(-1)), a
+        ),
+        newDerivativeMultiplyNode(b, b)
+    );
+}
+
+ptrDerivativeNode DerivativePowNode::operandPartial(int k){
+    return newDerivativeMultiplyNode(
+        ptrDerivativeNode(new ConstantDerivativeNode(p)),
+        newDerivativePowNode(a, p-1)
+    );
+}
+
+ptrDerivativeNode DerivativeExpNode::operandPartial(int k){
+    if(not copy_a)
+        copy_a = newDerivativeExpNode(a);
+    return copy_a;
+}
+
+ptrDerivativeNode DerivativeLogNode::operandPartial(int k){
+    return newDerivativeDivideNode(
+        ptrDerivativeNode(new ConstantDerivativeNode(1)), a
+    );
+}
+
+ptrDerivativeNode DerivativeIntPowNode::operandPartial(int k){
+    return newDerivativeMultiplyNode(
+        ptrDerivativeNode(new ConstantDerivativeNode(n)),
+        newDerivativeIntPowNode(a, n-1)
+    );
+}
+
+ptrDerivativeNode DerivativeSinNode::operandPartial(int k){
+    ptrDerivativeNode c = cos_a.lock();
+    if(not c){
+        c = newDerivativeCosNode(a);
+        cos_a = c;
+    }
+    return c;
+}
+
+ptrDerivativeNode DerivativeCosNode::operandPartial(int k){
+    return newDerivativeMultiplyNode(
+        ptrDerivativeNode(new ConstantDerivativeNode(-1)),
+        newDerivativeSinNode(a)
+    );
+}
+
+ptrDerivativeNode DerivativeTanhNode::operandPartial(int k){
+    if(not copy_a)
+        copy_a = newDerivativeTanhNode(a);
+    return newDerivativeSubNode(
+        ptrDerivativeNode(new ConstantDerivativeNode(1)),
+        newDerivativeMultiplyNode(copy_a, copy_a)
+    );
+}
+
+ptrDerivativeNode DerivativeSqrtNode::operandPartial(int k){
+    if(not copy_a)
+        copy_a = newDerivativeSqrtNode(a);
+    return newDerivativeDivideNode(
+        ptrDerivativeNode(new ConstantDerivativeNode(1)),
+        newDerivativeMultiplyNode(
+            ptrDerivativeNode(new ConstantDerivativeNode(2)), copy_a
+        )
+    );
+}
+
+ptrDerivativeNode DerivativeSigmoidNode::operandPartial(int k){
+    if(not copy_a)
+        copy_a = newDerivativeSigmoidNode(a);
+    return newDerivativeMultiplyNode(
+        copy_a,
+        newDerivativeSubNode(
+            ptrDerivativeNode(new ConstantDerivativeNode(1)), copy_a
+        )
+    );
+}
+
+ptrDerivativeNode DerivativeSoftplusNode::operandPartial(int k){
+    if(not sigmoid_a)
+        sigmoid_a = newDerivativeSigmoidNode(a);
+    return sigmoid_a;
+}
+
+ptrDerivativeNode DerivativeAbsNode::operandPartial(int k){
+    return newDerivativeSignNode(a);
+}
+
+ptrDerivativeNode DerivativeSignNode::operandPartial(int k){
+    return ptrDerivativeNode(new ConstantDerivativeNode(0));
+}
+
+// Operator on Wrapper
+
+Derivative operator+(const Derivative& a, const Derivative& b){
+    return newDerivativeAddNode(a.inst, b.inst);
+}
+
+Derivative operator-(const Derivative& a, const Derivative& b){
+    return newDerivativeSubNode(a.inst, b.inst);
+}
+
+Derivative operator*(const Derivative& a, const Derivative& b){
+    return newDerivativeMultiplyNode(a.inst, b.inst);
+}
+
+Derivative operator/(const Derivative& a, const Derivative& b){
+    return newDerivativeDivideNode(a.inst, b.inst);
+}
+
+Derivative pow(const Derivative& a, double p){
+    return newDerivativePowNode(a.inst, p);
+}
+
+Derivative exp(const Derivative& a){
+    return newDerivativeExpNode(a.inst);
+}
+
+Derivative log(const Derivative& a){
+    return newDerivativeLogNode(a.inst);
+}
+
+Derivative sin(const Derivative& a){
+    return newDerivativeSinNode(a.inst);
+}
+
+Derivative cos(const Derivative& a){
+    return newDerivativeCosNode(a.inst);
+}
+
+Derivative tanh(const Derivative& a){
+    return newDerivativeTanhNode(a.inst);
+}
+
+Derivative sqrt(const Derivative& a){
+    return newDerivativeSqrtNode(a.inst);
+}
+
+Derivative sigmoid(const Derivative& a){
+    return newDerivativeSigmoidNode(a.inst);
+}
+
+Derivative softplus(const Derivative& a){
+    return newDerivativeSoftplusNode(a.inst);
+}
+
+Derivative abs(const Derivative& a){
+    return newDerivativeAbsNode(a.inst);
+}
+
+Derivative sum(const Derivative& term, int begin, int end, int stride){
+    return newDerivativeSumNode(term.inst, begin, end, stride);
+}
+
+std::pair<Derivative, Derivative> sincos(const Derivative& a){
+    DerivativeSinNode* s = new DerivativeSinNode(a.inst);
+    ptrDerivativeNode ps(s), pc = newDerivativeCosNode(a.inst);
+    s->cos_a = pc;
+    return std::make_pair(Derivative(ps), Derivative(pc));
+}
+
+
+// Vectorized kernels
+
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+// Clone kernels for each instruction set, the CPU picks one at runtime
+#define DERIVATIVE_TARGET_CLONES __attribute__((target_clones("avx512f", "avx2", "sse4.1", "default")))
+#else
+#define DERIVATIVE_TARGET_CLONES
+#endif
+
+// The kernels are written as branch free loops for the compiler to
+// vectorize. They never raise floating point exception on purpose, so let
+// selects be if-converted, and keep error-free transformations exact.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC push_options
+#pragma GCC optimize("no-trapping-math", "fp-contract=off")
+#endif
+
+#if defined(__GNUC__)
+#define DERIVATIVE_INLINE __attribute__((always_inline)) inline
+#else
+#define DERIVATIVE_INLINE inline
+#endif
+
+namespace {
+
+DERIVATIVE_INLINE int64_t bitsOf(double x){
+    int64_t ret;
+    std::memcpy(&ret, &x, sizeof(ret));
+    return ret;
+}
+
+DERIVATIVE_INLINE double fromBits(int64_t b){
+    double ret;
+    std::memcpy(&ret, &b, sizeof(ret));
+    return ret;
+}
+
+// Adding it rounds a double to integer, which is then in the low bits
+const double round_magic = 6755399441055744.0;
+
+// 2^k for integer k in [-1022, 1023] saved in double
+DERIVATIVE_INLINE double powerOfTwo(double k){
+    return fromBits((bitsOf(k + round_magic) - bitsOf(round_magic) + 1023) << 52);
+}
+
+const double ln2_hi = 6.93147180369123816490e-01,
+             ln2_lo = 1.90821492927058770002e-10,
+             log2e = 1.44269504088896338700e+00;
+
+// exp(x), same reduction and rational approximation as fdlibm
+DERIVATIVE_INLINE double expKernel(double x){
+    const double P1 = 1.66666666666666019037e-01,
+                 P2 = -2.77777777770155933842e-03,
+                 P3 = 6.61375632143793436117e-05,
+                 P4 = -1.65339022054652515390e-06,
+                 P5 = 4.13813679705723846039e-08;
+
+    x = x > 710 ? 710 : x;
+    x = x < -746 ? -746 : x;
+
+    double kd = (x*log2e + round_magic) - round_magic;
+
+    double hi = x - kd*ln2_hi, lo = kd*ln2_lo, r = hi - lo;
+    double rr = r*r;
+    double c = r - rr*(P1 + rr*(P2 + rr*(P3 + rr*(P4 + rr*P5))));
+    double y = 1 - ((lo - (r*c)/(2 - c)) - hi);
+
+    // Scale by 2^k in two steps, so subnormal and overflow are right
+    double k1 = (kd*0.5 + round_magic) - round_magic, k2 = kd - k1;
+    return y*powerOfTwo(k1)*powerOfTwo(k2);
+}
+
+// log(x) = hi + lo for positive x, same reduction and approximation as
+// fdlibm, with the rounding error of the sum kept in lo
+DERIVATIVE_INLINE void logKernel(double x, double& hi, double& lo){
+    const double Lg1 = 6.666666666666735130e-01,
+                 Lg2 = 3.999999999940941908e-01,
+                 Lg3 = 2.857142874366239149e-01,
+                 Lg4 = 2.222219843214978396e-01,
+                 Lg5 = 1.818357216161805012e-01,
+                 Lg6 = 1.531383769920937332e-01,
+                 Lg7 = 1.479819860511658591e-01;
+
+    // Subnormal is scaled into normal range first
+    bool sub = x < 2.2250738585072014e-308;
+    double scaled = x*18014398509481984.0;
+    double xs = sub ? scaled : x;
+    uint64_t b = bitsOf(xs);
+    double e = fromBits((b >> 52) + bitsOf(round_magic)) - round_magic - (sub ? 1077 : 1023);
+    double m = fromBits((b & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL);
+
+    // m in [sqrt(2)/2, sqrt(2))
+    bool big = m > 1.4142135623730951;
+    double half = m*0.5, e1 = e + 1;
+    m = big ? half : m;
+    double k = big ? e1 : e;
+
+    double f = m - 1, s = f/(2 + f), z = s*s, w = z*z;
+    double R = w*(Lg2 + w*(Lg4 + w*Lg6)) + z*(Lg1 + w*(Lg3 + w*(Lg5 + w*Lg7)));
+    double hfsq = 0.5*f*f;
+    double corr = s*(hfsq + R) - hfsq;
+
+    // k*ln2_hi is exact, f is exact
+    double a = k*ln2_hi, sum = a + f;
+    double err = (a - sum) + f + (corr + k*ln2_lo);
+
+    // Normalize so that |lo| is within half ulp of hi
+    hi = sum + err;
+    lo = err - (hi - sum);
+}
+
+} // namespace
+
+DERIVATIVE_TARGET_CLONES
+void batchExp(const double* in, double* out, int n){
+#pragma omp simd
+    for(int li = 0;li < n;li++)
+        out[li] = expKernel(in[li]);
+}
+
+DERIVATIVE_TARGET_CLONES
+void batchLog(const double* in, double* out, int n){
+    const double inf = std::numeric_limits<double>::infinity(),
+                 nan = std::numeric_limits<double>::quiet_NaN();
+#pragma omp simd
+    for(int li = 0;li < n;li++){
+        double x = in[li], hi, lo;
+        logKernel(x, hi, lo);
+        double r = hi + lo;
+        r = x == inf ? inf : r;
+        r = x == 0 ? -inf : r;
+        r = x < 0 ? nan : r;
+        out[li] = x != x ? x : r;
+    }
+}
+
+DERIVATIVE_TARGET_CLONES
+void batchPow(const double* in, double p, double* out, int n){
+    const double inf = std::numeric_limits<double>::infinity(),
+                 nan = std::numeric_limits<double>::quiet_NaN();
+
+    // Infinite or NaN exponent is rare, leave its special cases to std::pow
+    if(not std::isfinite(p)){
+        for(int li = 0;li < n;li++)
+            out[li] = std::pow(in[li], p);
+        return;
+    }
+
+    // Sign of negative base is defined only for integer exponent
+    bool integer = std::floor(p) == p;
+    bool odd = integer and std::fmod(p, 2) != 0;
+
+    // Value at zero and at infinity
+    const double at_zero = p > 0 ? 0.0 : inf, at_inf = p > 0 ? inf : 0.0;
+    // Split p for Dekker's product
+    const double split = 134217729.0;
+    double ph = p*split;
+    ph = ph - (ph - p);
+    double pl = p - ph;
+
+#pragma omp simd
+    for(int li = 0;li < n;li++){
+        double x = in[li], ax = x < 0 ? -x : x, hi, lo;
+        logKernel(ax, hi, lo);
+
+        // y = p*(hi + lo) in double-double by Dekker's product
+        double yh = p*hi;
+        double hh = hi*split;
+        hh = hh - (hh - hi);
+        double hl = hi - hh;
+        double yl = ((ph*hh - yh) + ph*hl + pl*hh) + pl*hl + p*lo;
+
+        double r = expKernel(yh), corrected = r + r*yl;
+        r = (yh > -746) & (yh < 710) ? corrected : r;
+        r = ax == 0 ? at_zero : r;
+        r = ax == inf ? at_inf : r;
+        r = (x < 0) & not integer & (ax != inf) ? nan : r;
+        double neg = -r;
+        r = (bitsOf(x) < 0) & odd ? neg : r;
+        r = x != x ? x : r;
+        r = (p == 0) | (x == 1) ? 1.0 : r;
+        out[li] = r;
+    }
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC pop_options
+#endif
+
+
+namespace{
+
+void sinCos(double a, double& s, double& c){
+#if defined(__GLIBC__)
+    ::sincos(a, &s, &c);
+#else
+    s = std::sin(a), c = std::cos(a);
+#endif
+}
+
+// A Sin or Cos paired by ind, the first of the pair on the tape computes
+// both values on val. Return false for any other entry.
+bool pairedSinCos(const DerivativeTapeEntry& e, int lk, double* val){
+    if(e.ind < 0 or (e.op != OpSin and e.op != OpCos))
+        return false;
+    if(e.ind > lk)
+        sinCos(val[e.arg[0]], val[e.op == OpSin ? lk : e.ind], val[e.op == OpSin ? e.ind : lk]);
+    return true;
+}
+
+} // namespace
+
+
+// Flatten the graph onto tape
+
+DerivativeTapeEntry::DerivativeTapeEntry():op(OpConstant), ind(-1), p(0), end(0), stride(1), sub(-1){
+    arg[0] = arg[1] = -1;
+}
+
+void ConstantDerivativeNode::record(DerivativeTapeEntry& entry) const {
+    entry.op = OpConstant;
+    entry.p = a;
+}
+
+void VariableDerivativeNode::record(DerivativeTapeEntry& entry) const {
+    entry.op = OpVariable;
+    entry.ind = ind;
+}
+
+void ParameterDerivativeNode::record(DerivativeTapeEntry& entry) const {
+    entry.op = OpParameter;
+    entry.ind = ind;
+}
+
+void LinearDerivativeNode::record(DerivativeTapeEntry& entry) const {
+    entry.op = OpLinear;
+    entry.v = v;
+}
+
+int DerivativeAddNode::numOperands() const { return 2; }
+int DerivativeSubNode::numOperands() const { return 2; }
+int DerivativeMultiplyNode::numOperands() const { return 2; }
+int DerivativeDivideNode::numOperands() const { return 2; }
+int DerivativePowNode::numOperands() const { return 1; }
+int DerivativeExpNode::numOperands() const { return 1; }
+int DerivativeLogNode::numOperands() const { return 1; }
+int DerivativeIntPowNode::numOperands() const { return 1; }
+int DerivativeSinNode::numOperands() const { return 1; }
+int DerivativeCosNode::numOperands() const { return 1; }
+int DerivativeTanhNode::numOperands() const { return 1; }
+int DerivativeSqrtNode::numOperands() const { return 1; }
+int DerivativeSigmoidNode::numOperands() const { return 1; }
+int DerivativeSoftplusNode::numOperands() const { return 1; }
+int DerivativeAbsNode::numOperands() const { return 1; }
+int DerivativeSignNode::numOperands() const { return 1; }
+
+ptrDerivativeNode DerivativeAddNode::operand(int k) const { return k ? b : a; }
+ptrDerivativeNode DerivativeSubNode::operand(int k) const { return k ? b : a; }
+ptrDerivativeNode DerivativeMultiplyNode::operand(int k) const { return k ? b : a; }
+ptrDerivativeNode DerivativeDivideNode::operand(int k) const { return k ? b : a; }
+ptrDerivativeNode DerivativePowNode::operand(int k) const { return a; }
+ptrDerivativeNode DerivativeExpNode::operand(int k) const { return a; }
+ptrDerivativeNode DerivativeLogNode::operand(int k) const { return a; }
+ptrDerivativeNode DerivativeIntPowNode::operand(int k) const { return a; }
+ptrDerivativeNode DerivativeSinNode::operand(int k) const { return a; }
+ptrDerivativeNode DerivativeCosNode::operand(int k) const { return a; }
+ptrDerivativeNode DerivativeTanhNode::operand(int k) const { return a; }
+ptrDerivativeNode DerivativeSqrtNode::operand(int k) const { return a; }
+ptrDerivativeNode DerivativeSigmoidNode::operand(int k) const { return a; }
+ptrDerivativeNode DerivativeSoftplusNode::operand(int k) const { return a; }
+ptrDerivativeNode DerivativeAbsNode::operand(int k) const { return a; }
+ptrDerivativeNode DerivativeSignNode::operand(int k) const { return a; }
+
+void DerivativeAddNode::record(DerivativeTapeEntry& entry) const { entry.op = OpAdd; }
+void DerivativeSubNode::record(DerivativeTapeEntry& entry) const { entry.op = OpSub; }
+void DerivativeMultiplyNode::record(DerivativeTapeEntry& entry) const { entry.op = OpMultiply; }
+void DerivativeDivideNode::record(DerivativeTapeEntry& entry) const { entry.op = OpDivide; }
+void DerivativeExpNode::record(DerivativeTapeEntry& entry) const { entry.op = OpExp; }
+void DerivativeLogNode::record(DerivativeTapeEntry& entry) const { entry.op = OpLog; }
+void DerivativeSinNode::record(DerivativeTapeEntry& entry) const { entry.op = OpSin; }
+void DerivativeCosNode::record(DerivativeTapeEntry& entry) const { entry.op = OpCos; }
+void DerivativeTanhNode::record(DerivativeTapeEntry& entry) const { entry.op = OpTanh; }
+void DerivativeSqrtNode::record(DerivativeTapeEntry& entry) const { entry.op = OpSqrt; }
+void DerivativeSigmoidNode::record(DerivativeTapeEntry& entry) const { entry.op = OpSigmoid; }
+void DerivativeSoftplusNode::record(DerivativeTapeEntry& entry) const { entry.op = OpSoftplus; }
+void DerivativeAbsNode::record(DerivativeTapeEntry& entry) const { entry.op = OpAbs; }
+void DerivativeSignNode::record(DerivativeTapeEntry& entry) const { entry.op = OpSign; }
+
+void DerivativeIntPowNode::record(DerivativeTapeEntry& entry) const {
+    entry.op = OpIntPow;
+    entry.ind = n;
+}
+
+ptrDerivativeNode DerivativeAddNode::rebuild(const std::vector<ptrDerivativeNode>& operands) const {
+    return newDerivativeAddNode(operands[0], operands[1]);
+}
+
+ptrDerivativeNode DerivativeSubNode::rebuild(const std::vector<ptrDerivativeNode>& operands) const {
+    return newDerivativeSubNode(operands[0], operands[1]);
+}
+
+ptrDerivativeNode DerivativeMultiplyNode::rebuild(const std::vector<ptrDerivativeNode>& operands) const {
+    return newDerivativeMultiplyNode(operands[0], operands[1]);
+}
+
+ptrDerivativeNode DerivativeDivideNode::rebuild(const std::vector<ptrDerivativeNode>& operands) const {
+    return newDerivativeDivideNode(operands[0], operands[1]);
+}
+
+ptrDerivativeNode DerivativePowNode::rebuild(const std::vector<ptrDerivativeNode>& operands) const {
+    return newDerivativePowNode(operands[0], p);
+}
+
+ptrDerivativeNode DerivativeExpNode::rebuild(const std::vector<ptrDerivativeNode>& operands) const {
+    return newDerivativeExpNode(operands[0]);
+}
+
+ptrDerivativeNode DerivativeLogNode::rebuild(const std::vector<ptrDerivativeNode>& operands) const {
+    return newDerivativeLogNode(operands[0]);
+}
+
+ptrDerivativeNode DerivativeIntPowNode::rebuild(const std::vector<ptrDerivativeNode>& operands) const {
+    return newDerivativeIntPowNode(operands[0], n);
+}
+
+ptrDerivativeNode DerivativeSinNode::rebuild(const std::vector<ptrDerivativeNode>& operands) const {
+    return newDerivativeSinNode(operands[0]);
+}
+
+ptrDerivativeNode DerivativeCosNode::rebuild(const std::vector<ptrDerivativeNode>& operands) const {
+    return newDerivativeCosNode(operands[0]);
+}
+
+ptrDerivativeNode DerivativeTanhNode::rebuild(const std::vector<ptrDerivativeNode>& operands) const {
+    return newDerivativeTanhNode(operands[0]);
+}
+
+ptrDerivativeNode DerivativeSqrtNode::rebuild(const std::vector<ptrDerivativeNode>& operands) const {
+    return newDerivativeSqrtNode(operands[0]);
+}
+
+ptrDerivativeNode DerivativeSigmoidNode::rebuild(const std::vector<ptrDerivativeNode>& operands) const {
+    return newDerivativeSigmoidNode(operands[0]);
+}
+
+ptrDerivativeNode DerivativeSoftplusNode::rebuild(const std::vector<ptrDerivativeNode>& operands) const {
+    return newDerivativeSoftplusNode(operands[0]);
+}
+
+ptrDerivativeNode DerivativeAbsNode::rebuild(const std::vector<ptrDerivativeNode>& operands) const {
+    return newDerivativeAbsNode(operands[0]);
+}
+
+ptrDerivativeNode DerivativeSignNode::rebuild(const std::vector<ptrDerivativeNode>& operands) const {
+    return newDerivativeSignNode(operands[0]);
+}
+
+void DerivativePowNode::record(DerivativeTapeEntry& entry) const {
+    entry.op = OpPow;
+    entry.p = p;
+}
+
+
+DerivativeTape::DerivativeTape(const std::vector<Derivative>& roots){
+    // Slot of each visited node, and the number of sums
+    std::unordered_map<const DerivativeNode*, int> slot;
+    int sums = 0;
+
+    // Post-order DFS without recursion, graph might be very deep
+    std::vector< std::pair<ptrDerivativeNode, int> > stack;
+
+    for(const Derivative& root : roots){
+        // inst might be null
+        assert(root.inst);
+        if(not slot.count(root.inst.get()))
+            stack.push_back(std::make_pair(root.inst, 0));
+
+        while(not stack.empty()){
+            ptrDerivativeNode node = stack.back().first;
+            int k = stack.back().second;
+
+            if(k < node->numOperands()){
+                stack.back().second++;
+                ptrDerivativeNode child = node->operand(k);
+                if(not slot.count(child.get()))
+                    stack.push_back(std::make_pair(child, 0));
+                continue;
+            }
+
+            stack.pop_back();
+            if(slot.count(node.get()))
+                continue;
+
+            DerivativeTapeEntry entry;
+            node->record(entry);
+            assert(entry.op != OpOpaque and "DerivativeTape can't take an opaque node.");
+            if(entry.op == OpSum)
+                entry.sub = sums++;
+            for(int lk = 0;lk < node->numOperands();lk++)
+                entry.arg[lk] = slot[node->operand(lk).get()];
+
+            slot[node.get()] = entries.size();
+            entries.push_back(entry);
+        }
+
+        outputs.push_back(slot[root.inst.get()]);
+    }
+
+    // Pair the Sin and Cos of the same operand, the first of them on the
+    // tape computes both by one sincos
+    std::unordered_map<int, int> sin_slot;
+    for(int lk = 0;lk < (int)entries.size();lk++)
+        if(entries[lk].op == OpSin)
+            sin_slot.insert(std::make_pair(entries[lk].arg[0], lk));
+    for(int lk = 0;lk < (int)entries.size();lk++){
+        if(entries[lk].op != OpCos)
+            continue;
+        auto it = sin_slot.find(entries[lk].arg[0]);
+        if(it != sin_slot.end() and entries[it->second].ind < 0)
+            entries[lk].ind = it->second, entries[it->second].ind = lk;
+    }
+}
+
+int DerivativeTape::size() const {
+    return entries.size();
+}
+
+int DerivativeTape::numOutputs() const {
+    return outputs.size();
+}
+
+int DerivativeTape::numVariables() const {
+    int ret = 0;
+    for(const DerivativeTapeEntry& e : entries)
+        if(e.op == OpVariable)
+            ret = std::max(ret, e.ind + 1);
+        else if(e.op == OpLinear)
+            ret = std::max(ret, (int)e.v.size());
+        else if(e.op == OpSum)
+            ret = std::max(ret, (e.end - 1)*e.stride + e.term->numVariables());
+    return ret;
+}
+
+DerivativeWorkspace& DerivativeTape::sumWorkspace(const DerivativeTapeEntry& e, DerivativeWorkspace& ws){
+    if((int)ws.sub.size() <= e.sub)
+        ws.sub.resize(e.sub + 1);
+    DerivativeWorkspace& sub = ws.sub[e.sub];
+    sub.param = ws.param;
+    return sub;
+}
+
+double DerivativeTape::sumValue(const DerivativeTapeEntry& e, const DerivativeInput& x, DerivativeWorkspace& ws){
+    DerivativeWorkspace& sub = sumWorkspace(e, ws);
+    int width = e.term->numVariables();
+
+    double ret = 0, term;
+    for(int li = e.ind;li < e.end;li++){
+        e.term->evaluate(x.segment(li*e.stride, width), Map<VectorXd>(&term, 1), sub);
+        ret += term;
+    }
+    return ret;
+}
+
+void DerivativeTape::sumGradient(const DerivativeTapeEntry& e, const DerivativeInput& x, double w, Ref<VectorXd, 0, InnerStride<> > g, DerivativeWorkspace& ws){
+    if(w == 0)
+        return;
+
+    DerivativeWorkspace& sub = sumWorkspace(e, ws);
+    int width = e.term->numVariables();
+    sub.term.resize(width);
+
+    for(int li = e.ind;li < e.end;li++){
+        e.term->gradient(x.segment(li*e.stride, width), Map<const VectorXd>(&w, 1), sub.term, sub);
+        g.segment(li*e.stride, width) += sub.term;
+    }
+}
+
+void DerivativeTape::sumTangent(const DerivativeTapeEntry& e, const DerivativeInput& x, const int* color, const double* seed, Ref<VectorXd> tan, DerivativeWorkspace& ws){
+    DerivativeWorkspace& sub = sumWorkspace(e, ws);
+    Map<const MatrixXd> S(seed, seed ? x.size() : 0, tan.size());
+    int width = e.term->numVariables();
+    sub.term.resize(width);
+    double one = 1;
+
+    // Direction of each variable the same as hessianSweep
+    for(int li = e.ind;li < e.end;li++){
+        e.term->gradient(x.segment(li*e.stride, width), Map<const VectorXd>(&one, 1), sub.term, sub);
+        for(int lx = 0;lx < width;lx++){
+            int ind = li*e.stride + lx;
+            if(sub.term[lx] == 0)
+                continue;
+            if(seed)
+                tan += sub.term[lx]*S.row(ind).transpose();
+            else{
+                int c = color ? color[ind] : ind;
+                if(c >= 0)
+                    tan[c] += sub.term[lx];
+            }
+        }
+    }
+}
+
+void DerivativeTape::sumSecond(const DerivativeTapeEntry& e, const DerivativeInput& x, double adj, const Ref<const VectorXd>& adj2, const int* color, const double* seed, Ref<MatrixXd> HS, DerivativeWorkspace& ws){
+    if(adj == 0 and adj2.isZero(0))
+        return;
+
+    DerivativeWorkspace& sub = sumWorkspace(e, ws);
+    Map<const MatrixXd> S(seed, seed ? x.size() : 0, HS.cols());
+    int width = e.term->numVariables();
+    sub.term.resize(width);
+    sub.term_hess.resize(width, width);
+    double one = 1;
+
+    for(int li = e.ind;li < e.end;li++){
+        int first = li*e.stride;
+        DerivativeInput xi = x.segment(first, width);
+
+        // The gradient of the term takes adj2 as a variable does, and its
+        // Hessian takes adj along the directions of its variables
+        e.term->gradient(xi, Map<const VectorXd>(&one, 1), sub.term, sub);
+        HS.middleRows(first, width).noalias() += sub.term*adj2.transpose();
+
+        if(adj == 0)
+            continue;
+        e.term->hessian(xi, Map<const VectorXd>(&adj, 1), sub.term_hess, sub);
+        if(seed)
+            HS.middleRows(first, width).noalias() += sub.term_hess*S.middleRows(first, width);
+        else
+            for(int ly = 0;ly < width;ly++){
+                int c = color ? color[first + ly] : first + ly;
+                if(c >= 0)
+                    HS.block(first, c, width, 1) += sub.term_hess.col(ly);
+            }
+    }
+}
+
+void DerivativeTape::forward(const DerivativeInput& x, DerivativeWorkspace& ws) const {
+    int n = entries.size();
+    VectorXd& val = ws.val;
+    MatrixXd& d1 = ws.d1;
+    MatrixXd& d2 = ws.d2;
+
+    val.resize(n);
+    d1.setZero(n, 2);
+    d2.setZero(n, 3);
+
+    for(int lk = 0;lk < n;lk++){
+        const DerivativeTapeEntry& e = entries[lk];
+        double a = e.arg[0] >= 0 ? val[e.arg[0]] : 0,
+               b = e.arg[1] >= 0 ? val[e.arg[1]] : 0;
+
+        if(e.op == OpSum)
+            val[lk] = sumValue(e, x, ws);
+        else if(not pairedSinCos(e, lk, val.data()))
+            val[lk] = apply<double>(e, x, val.data(), ws.param.data());
+
+        switch(e.op){
+        case OpAdd:
+            d1(lk, 0) = 1, d1(lk, 1) = 1;
+            break;
+        case OpSub:
+            d1(lk, 0) = 1, d1(lk, 1) = -1;
+            break;
+        case OpMultiply:
+            d1(lk, 0) = b, d1(lk, 1) = a;
+            d2(lk, 1) = 1;
+            break;
+        case OpDivide:
+            d1(lk, 0) = 1/b, d1(lk, 1) = -a/(b*b);
+            d2(lk, 1) = -1/(b*b), d2(lk, 2) = 2*a/(b*b*b);
+            break;
+        case OpPow:
+            d1(lk, 0) = e.p*std::pow(a, e.p - 1);
+            d2(lk, 0) = e.p*(e.p - 1)*std::pow(a, e.p - 2);
+            break;
+        case OpExp:
+            d1(lk, 0) = d2(lk, 0) = val[lk];
+            break;
+        case OpLog:
+            d1(lk, 0) = 1/a, d2(lk, 0) = -1/(a*a);
+            break;
+        case OpIntPow:
+            d1(lk, 0) = e.ind*derivativeIntPow(a, e.ind - 1);
+            d2(lk, 0) = e.ind*(e.ind - 1)*derivativeIntPow(a, e.ind - 2);
+            break;
+        case OpSin:
+            d1(lk, 0) = e.ind >= 0 ? val[e.ind] : std::cos(a), d2(lk, 0) = -val[lk];
+            break;
+        case OpCos:
+            d1(lk, 0) = -(e.ind >= 0 ? val[e.ind] : std::sin(a)), d2(lk, 0) = -val[lk];
+            break;
+        case OpTanh:
+            d1(lk, 0) = 1 - val[lk]*val[lk];
+            d2(lk, 0) = -2*val[lk]*d1(lk, 0);
+            break;
+        case OpSqrt:
+            d1(lk, 0) = 0.5/val[lk], d2(lk, 0) = -0.25/(val[lk]*a);
+            break;
+        case OpSigmoid:
+            d1(lk, 0) = val[lk]*(1 - val[lk]);
+            d2(lk, 0) = d1(lk, 0)*(1 - 2*val[lk]);
+            break;
+        case OpSoftplus:{
+            double s = DerivativeScalarTraits<double>::sigmoid(a);
+            d1(lk, 0) = s, d2(lk, 0) = s*(1 - s);
+            break;
+        }
+        case OpAbs:
+            d1(lk, 0) = DerivativeScalarTraits<double>::sign(a);
+            break;
+        default:
+            // Leaf has no operand
+            break;
+        }
+    }
+}
+
+void DerivativeTape::reverse(const DerivativeInput& x, Ref<VectorXd, 0, InnerStride<> > g, DerivativeWorkspace& ws) const {
+    const MatrixXd& d1 = ws.d1;
+    VectorXd& adj = ws.adj;
+
+    g.setZero();
+    for(int lk = entries.size()-1;lk >= 0;lk--){
+        const DerivativeTapeEntry& e = entries[lk];
+        if(e.op == OpVariable)
+            g[e.ind] += adj[lk];
+        else if(e.op == OpLinear)
+            g += adj[lk]*e.v;
+        else if(e.op == OpSum)
+            sumGradient(e, x, adj[lk], g, ws);
+
+        for(int la = 0;la < 2;la++)
+            if(e.arg[la] >= 0)
+                adj[e.arg[la]] += adj[lk]*d1(lk, la);
+    }
+}
+
+void DerivativeTape::evaluate(const DerivativeInput& x, Ref<VectorXd> out, DerivativeWorkspace& ws) const {
+    assert(out.size() == (int)outputs.size());
+
+    VectorXd& val = ws.val;
+    val.resize(entries.size());
+    for(int lk = 0;lk < (int)entries.size();lk++){
+        const DerivativeTapeEntry& e = entries[lk];
+        if(e.op == OpSum)
+            val[lk] = sumValue(e, x, ws);
+        else if(not pairedSinCos(e, lk, val.data()))
+            val[lk] = apply<double>(e, x, val.data(), ws.param.data());
+    }
+
+    for(int lo = 0;lo < (int)outputs.size();lo++)
+        out[lo] = val[outputs[lo]];
+}
+
+void DerivativeTape::gradient(const DerivativeInput& x, const Ref<const VectorXd>& w, Ref<VectorXd> g, DerivativeWorkspace& ws) const {
+    assert(w.size() == (int)outputs.size());
+    assert(g.size() == x.size());
+
+    forward(x, ws);
+
+    ws.adj.setZero(entries.size());
+    for(int lo = 0;lo < (int)outputs.size();lo++)
+        ws.adj[outputs[lo]] += w[lo];
+
+    reverse(x, g, ws);
+}
+
+void DerivativeTape::jacobian(const DerivativeInput& x, Ref<MatrixXd> J, DerivativeWorkspace& ws) const {
+    assert(J.rows() == (int)outputs.size());
+    assert(J.cols() == x.size());
+
+    // Partial differential of entries is shared by all the reverse sweeps
+    forward(x, ws);
+
+    for(int lo = 0;lo < (int)outputs.size();lo++){
+        ws.adj.setZero(entries.size());
+        ws.adj[outputs[lo]] = 1;
+        reverse(x, J.row(lo).transpose(), ws);
+    }
+}
+
+void DerivativeTape::hessian(const DerivativeInput& x, const Ref<const VectorXd>& w, Ref<MatrixXd> H, DerivativeWorkspace& ws) const {
+    assert(H.rows() == x.size() and H.cols() == x.size());
+    hessianSweep(x, w, nullptr, nullptr, x.size(), H, ws);
+}
+
+void DerivativeTape::hessianVectorProduct(const DerivativeInput& x, const Ref<const VectorXd>& w, const Ref<const VectorXd>& v, Ref<VectorXd> Hv, DerivativeWorkspace& ws) const {
+    assert(v.size() == x.size() and Hv.size() == x.size());
+    hessianSweep(x, w, nullptr, v.data(), 1, Map<MatrixXd>(Hv.data(), Hv.size(), 1), ws);
+}
+
+void DerivativeTape::hessianSweep(const DerivativeInput& x, const Ref<const VectorXd>& w, const int* color, const double* seed, int directions, Ref<MatrixXd> HS, DerivativeWorkspace& ws) const {
+    assert(w.size() == (int)outputs.size());
+    assert(HS.rows() == x.size() and HS.cols() == directions);
+    Map<const MatrixXd> S(seed, seed ? x.size() : 0, directions);
+
+    int n = entries.size();
+    forward(x, ws);
+
+    const MatrixXd& d1 = ws.d1;
+    const MatrixXd& d2 = ws.d2;
+    VectorXd& adj = ws.adj;
+
+    // Tangent and second order adjoint of each entry, one column per entry
+    // and one row per direction.
+    MatrixXd& tan = ws.tan;
+    MatrixXd& adj2 = ws.adj2;
+    tan.setZero(directions, n);
+    adj2.setZero(directions, n);
+    adj.setZero(n);
+    HS.setZero();
+
+    for(int lk = 0;lk < n;lk++){
+        const DerivativeTapeEntry& e = entries[lk];
+        if(e.op == OpVariable and seed)
+            tan.col(lk) = S.row(e.ind).transpose();
+        else if(e.op == OpVariable){
+            int c = color ? color[e.ind] : e.ind;
+            if(c >= 0)
+                tan(c, lk) = 1;
+        }
+        else if(e.op == OpLinear and seed)
+            tan.col(lk) = S.topRows(e.v.size()).transpose()*e.v;
+        else if(e.op == OpLinear){
+            if(not color)
+                tan.col(lk) = e.v;
+            else
+                for(int lx = 0;lx < e.v.size();lx++)
+                    if(e.v[lx] != 0 and color[lx] >= 0)
+                        tan(color[lx], lk) += e.v[lx];
+        }
+        else if(e.op == OpSum)
+            sumTangent(e, x, color, seed, tan.col(lk), ws);
+
+        for(int la = 0;la < 2;la++)
+            if(e.arg[la] >= 0)
+                tan.col(lk) += d1(lk, la)*tan.col(e.arg[la]);
+    }
+
+    for(int lo = 0;lo < (int)outputs.size();lo++)
+        adj[outputs[lo]] += w[lo];
+
+    for(int lk = n-1;lk >= 0;lk--){
+        const DerivativeTapeEntry& e = entries[lk];
+        int a = e.arg[0], b = e.arg[1];
+
+        if(e.op == OpVariable)
+            HS.row(e.ind) += adj2.col(lk).transpose();
+        else if(e.op == OpLinear)
+            HS.noalias() += e.v*adj2.col(lk).transpose();
+        else if(e.op == OpSum)
+            sumSecond(e, x, adj[lk], adj2.col(lk), color, seed, HS, ws);
+
+        if(a >= 0){
+            adj[a] += adj[lk]*d1(lk, 0);
+            adj2.col(a) += d1(lk, 0)*adj2.col(lk) + adj[lk]*d2(lk, 0)*tan.col(a);
+            if(b >= 0)
+                adj2.col(a) += adj[lk]*d2(lk, 1)*tan.col(b);
+        }
+
+        if(b >= 0){
+            adj[b] += adj[lk]*d1(lk, 1);
+            adj2.col(b) += d1(lk, 1)*adj2.col(lk)
+                + adj[lk]*(d2(lk, 1)*tan.col(a) + d2(lk, 2)*tan.col(b));
+        }
+    }
+}
+
+std::vector< std::vector<int> > DerivativeTape::dependency() const {
+    int n = entries.size();
+    std::vector< std::vector<int> > deps(n);
+
+    for(int lk = 0;lk < n;lk++){
+        const DerivativeTapeEntry& e = entries[lk];
+        std::vector<int>& d = deps[lk];
+
+        if(e.op == OpVariable)
+            d.push_back(e.ind);
+        else if(e.op == OpLinear){
+            for(int lx = 0;lx < e.v.size();lx++)
+                if(e.v[lx] != 0)
+                    d.push_back(lx);
+        }
+        else if(e.op == OpSum){
+            const DerivativeTape& term = *e.term;
+            std::vector<int> offsets = term.dependency()[term.outputs[0]];
+            for(int li = e.ind;li < e.end;li++)
+                for(int j : offsets)
+                    d.push_back(li*e.stride + j);
+            std::sort(d.begin(), d.end());
+            d.erase(std::unique(d.begin(), d.end()), d.end());
+        }
+        else if(e.arg[0] >= 0 and e.arg[1] >= 0)
+            std::set_union(deps[e.arg[0]].begin(), deps[e.arg[0]].end(),
+                           deps[e.arg[1]].begin(), deps[e.arg[1]].end(),
+                           std::back_inserter(d));
+        else if(e.arg[0] >= 0)
+            d = deps[e.arg[0]];
+    }
+
+    return deps;
+}
+
+void DerivativeTape::evaluateBatch(const Ref<const MatrixXd>& X, Ref<MatrixXd> out, DerivativeWorkspace& ws) const {
+    assert(out.rows() == (int)outputs.size() and out.cols() == X.cols());
+
+    int n = X.cols();
+    MatrixXd& val = ws.batch;
+    val.resize(n, entries.size());
+
+    for(int lk = 0;lk < (int)entries.size();lk++){
+        const DerivativeTapeEntry& e = entries[lk];
+        int a = e.arg[0], b = e.arg[1];
+
+        switch(e.op){
+        case OpConstant:
+            val.col(lk).setConstant(e.p);
+            break;
+        case OpVariable:
+            val.col(lk) = X.row(e.ind).transpose();
+            break;
+        case OpParameter:
+            val.col(lk).setConstant(ws.param[e.ind]);
+            break;
+        case OpLinear:
+            val.col(lk).noalias() = X.transpose()*e.v;
+            break;
+        case OpAdd:
+            val.col(lk) = val.col(a) + val.col(b);
+            break;
+        case OpSub:
+            val.col(lk) = val.col(a) - val.col(b);
+            break;
+        case OpMultiply:
+            val.col(lk) = val.col(a).cwiseProduct(val.col(b));
+            break;
+        case OpDivide:
+            val.col(lk) = val.col(a).cwiseQuotient(val.col(b));
+            break;
+        case OpPow:
+            batchPow(val.col(a).data(), e.p, val.col(lk).data(), n);
+            break;
+        case OpExp:
+            batchExp(val.col(a).data(), val.col(lk).data(), n);
+            break;
+        case OpLog:
+            batchLog(val.col(a).data(), val.col(lk).data(), n);
+            break;
+        case OpIntPow:
+            val.col(lk) = val.col(a).unaryExpr([&e](double v){ return derivativeIntPow(v, e.ind); });
+            break;
+        case OpSin:
+        case OpCos:
+            if(e.ind < 0 and e.op == OpSin)
+                val.col(lk) = val.col(a).array().sin();
+            else if(e.ind < 0)
+                val.col(lk) = val.col(a).array().cos();
+            else if(e.ind > lk){
+                // Paired, both by one sincos
+                double* s = val.col(e.op == OpSin ? lk : e.ind).data();
+                double* c = val.col(e.op == OpSin ? e.ind : lk).data();
+                for(int li = 0;li < n;li++)
+                    sinCos(val(li, a), s[li], c[li]);
+            }
+            break;
+        case OpTanh:
+            val.col(lk) = val.col(a).array().tanh();
+            break;
+        case OpSqrt:
+            val.col(lk) = val.col(a).cwiseSqrt();
+            break;
+        case OpSigmoid:
+            val.col(lk) = -val.col(a);
+            batchExp(val.col(lk).data(), val.col(lk).data(), n);
+            val.col(lk) = (1 + val.col(lk).array()).inverse();
+            break;
+        case OpSoftplus:
+            val.col(lk) = -val.col(a).cwiseAbs();
+            batchExp(val.col(lk).data(), val.col(lk).data(), n);
+            val.col(lk) = val.col(a).array().max(0.0) + val.col(lk).array().log1p();
+            break;
+        case OpAbs:
+            val.col(lk) = val.col(a).cwiseAbs();
+            break;
+        case OpSign:
+            val.col(lk) = val.col(a).unaryExpr([](double v){ return DerivativeScalarTraits<double>::sign(v); });
+            break;
+        case OpSum:{
+            DerivativeWorkspace& sub = sumWorkspace(e, ws);
+            int width = e.term->numVariables();
+            sub.term.resize(n);
+            val.col(lk).setZero();
+            for(int li = e.ind;li < e.end;li++){
+                e.term->evaluateBatch(X.middleRows(li*e.stride, width), Map<MatrixXd>(sub.term.data(), 1, n), sub);
+                val.col(lk) += sub.term;
+            }
+            break;
+        }
+        case OpOpaque:
+            break;
+        }
+    }
+
+    for(int lo = 0;lo < (int)outputs.size();lo++)
+        out.row(lo) = val.col(outputs[lo]).transpose();
+}
+
+MatrixXd DerivativeTape::evaluateBatch(const Ref<const MatrixXd>& X) const {
+    DerivativeWorkspace ws;
+    MatrixXd ret(outputs.size(), X.cols());
+    evaluateBatch(X, ret, ws);
+    return ret;
+}
+
+template<typename Data>
+void DerivativeTape::evaluateChunk(const DerivativeInput& x, const Data& data, int first, int rows, const DerivativeChunkFunction& f, DerivativeWorkspace& ws) const {
+    int m = outputs.size();
+    for(int lr = 0;lr < rows;lr++){
+        ws.param = data.row(lr).transpose();
+        jacobian(x, ws.jac.middleRows(lr*m, m), ws);
+        for(int lo = 0;lo < m;lo++)
+            ws.res[lr*m + lo] = ws.val[outputs[lo]];
+    }
+
+    f(first, ws.res.head(rows*m), ws.jac.topRows(rows*m));
+}
+
+void DerivativeTape::evaluateRows(const DerivativeInput& x, const Ref<const MatrixXd>& data, int chunk, const DerivativeChunkFunction& f, DerivativeWorkspace& ws) const {
+    assert(chunk > 0);
+
+    // Sized for a whole chunk, so the last one doesn't allocate
+    int m = outputs.size();
+    ws.res.resize(chunk*m);
+    ws.jac.resize(chunk*m, x.size());
+
+    for(int first = 0;first < data.rows();first += chunk){
+        int rows = std::min(chunk, (int)data.rows() - first);
+        evaluateChunk(x, data.middleRows(first, rows), first, rows, f, ws);
+    }
+}
+
+bool DerivativeTape::evaluateFile(const DerivativeInput& x, const std::string& path, int cols, int chunk, const DerivativeChunkFunction& f, DerivativeWorkspace& ws) const {
+    assert(chunk > 0 and cols > 0);
+
+    FILE* file = std::fopen(path.c_str(), "rb");
+    if(not file)
+        return false;
+
+    int m = outputs.size();
+    ws.res.resize(chunk*m);
+    ws.jac.resize(chunk*m, x.size());
+    ws.data.resize(chunk, cols);
+
+    bool ok = true;
+    for(int first = 0;;){
+        size_t count = std::fread(ws.data.data(), sizeof(double), (size_t)chunk*cols, file);
+
+        // Incomplete row at the end
+        if(count % cols){
+            ok = false;
+            break;
+        }
+
+        int rows = count/cols;
+        if(rows)
+            evaluateChunk(x, ws.data.topRows(rows), first, rows, f, ws);
+        first += rows;
+
+        if(rows < chunk){
+            ok = not std::ferror(file);
+            break;
+        }
+    }
+
+    std::fclose(file);
+    return ok;
+}
+
+VectorXd DerivativeTape::gradient(const DerivativeInput& x, const VectorXd& w) const {
+    DerivativeWorkspace ws;
+    VectorXd ret(x.size());
+    gradient(x, w, ret, ws);
+    return ret;
+}
+
+MatrixXd DerivativeTape::jacobian(const DerivativeInput& x) const {
+    DerivativeWorkspace ws;
+    MatrixXd ret(outputs.size(), x.size());
+    jacobian(x, ret, ws);
+    return ret;
+}
+
+MatrixXd DerivativeTape::hessian(const DerivativeInput& x, const VectorXd& w) const {
+    DerivativeWorkspace ws;
+    MatrixXd ret(x.size(), x.size());
+    hessian(x, w, ret, ws);
+    return ret;
+}
+
+
+namespace{
+
+// Greedy coloring of columns, the smallest color not used by any column
+// sharing a row. rows[j] are the rows of column j and cols[i] the columns of
+// row i. Column without any row is left -1. Return the number of colors.
+int colorColumns(const std::vector< std::vector<int> >& rows, const std::vector< std::vector<int> >& cols, std::vector<int>& color){
+    int num_colors = 0, size = rows.size();
+    color.assign(size, -1);
+    std::vector<int> used(size + 1, -1);
+
+    for(int lx = 0;lx < size;lx++){
+        if(rows[lx].empty())
+            continue;
+
+        for(int lr : rows[lx])
+            for(int ly : cols[lr])
+                if(color[ly] >= 0)
+                    used[color[ly]] = lx;
+
+        int c = 0;
+        while(used[c] == lx)
+            c++;
+        color[lx] = c;
+        num_colors = std::max(num_colors, c + 1);
+    }
+
+    return num_colors;
+}
+
+} // namespace
+
+DerivativeSparseJacobian::DerivativeSparseJacobian(const DerivativeTape& _tape, int x_size):tape(_tape){
+    int m = tape.outputs.size();
+    std::vector< std::vector<int> > deps = tape.dependency();
+
+    // Columns of each row and rows of each column
+    std::vector< std::vector<int> > cols(m), rows(x_size);
+    for(int lo = 0;lo < m;lo++){
+        cols[lo] = deps[tape.outputs[lo]];
+        for(int lx : cols[lo]){
+            assert(lx < x_size);
+            rows[lx].push_back(lo);
+        }
+    }
+
+    num_colors = colorColumns(rows, cols, color);
+
+    std::vector< Triplet<double> > pattern;
+    for(int lo = 0;lo < m;lo++)
+        for(int lx : cols[lo])
+            pattern.push_back(Triplet<double>(lo, lx, 0));
+
+    J.resize(m, x_size);
+    J.setFromTriplets(pattern.begin(), pattern.end());
+    J.makeCompressed();
+
+    for(int lx = 0;lx < J.outerSize();lx++)
+        for(SparseMatrix<double>::InnerIterator it(J, lx);it;++it){
+            nz_color.push_back(color[lx]);
+            nz_slot.push_back(tape.outputs[it.row()]);
+        }
+}
+
+int DerivativeSparseJacobian::numColors() const {
+    return num_colors;
+}
+
+const SparseMatrix<double>& DerivativeSparseJacobian::compute(const DerivativeInput& x, DerivativeWorkspace& ws){
+    assert(x.size() == J.cols());
+
+    const std::vector<DerivativeTapeEntry>& entries = tape.entries;
+    int n = entries.size();
+    tape.forward(x, ws);
+
+    // Tangent of each entry, one row for each color
+    const MatrixXd& d1 = ws.d1;
+    MatrixXd& tan = ws.tan;
+    tan.setZero(num_colors, n);
+
+    for(int lk = 0;lk < n;lk++){
+        const DerivativeTapeEntry& e = entries[lk];
+        if(e.op == OpVariable){
+            if(color[e.ind] >= 0)
+                tan(color[e.ind], lk) = 1;
+        }
+        else if(e.op == OpLinear){
+            for(int lx = 0;lx < e.v.size();lx++)
+                if(e.v[lx] != 0 and color[lx] >= 0)
+                    tan(color[lx], lk) += e.v[lx];
+        }
+        else if(e.op == OpSum)
+            DerivativeTape::sumTangent(e, x, color.data(), nullptr, tan.col(lk), ws);
+
+        for(int la = 0;la < 2;la++)
+            if(e.arg[la] >= 0)
+                tan.col(lk) += d1(lk, la)*tan.col(e.arg[la]);
+    }
+
+    double* value = J.valuePtr();
+    for(int lz = 0;lz < (int)nz_slot.size();lz++)
+        value[lz] = tan(nz_color[lz], nz_slot[lz]);
+
+    return J;
+}
+
+const SparseMatrix<double>& DerivativeSparseJacobian::matrix() const {
+    return J;
+}
+
+
+DerivativeSparseHessian::DerivativeSparseHessian(const DerivativeTape& _tape, int x_size):tape(_tape){
+    const std::vector<DerivativeTapeEntry>& entries = tape.entries;
+    std::vector< std::vector<int> > deps = tape.dependency();
+
+    // Variables each variable meets in a nonlinear operation
+    std::vector< std::vector<int> > adjacent(x_size);
+    auto cross = [&](const std::vector<int>& s, const std::vector<int>& t){
+        for(int li : s)
+            for(int lj : t){
+                assert(li < x_size and lj < x_size);
+                adjacent[li].push_back(lj);
+                adjacent[lj].push_back(li);
+            }
+    };
+
+    for(int lk = 0;lk < (int)entries.size();lk++){
+        const DerivativeTapeEntry& e = entries[lk];
+        switch(e.op){
+        case OpMultiply:
+            cross(deps[e.arg[0]], deps[e.arg[1]]);
+            break;
+        case OpDivide:
+            cross(deps[e.arg[0]], deps[e.arg[1]]);
+            cross(deps[e.arg[1]], deps[e.arg[1]]);
+            break;
+        case OpPow: case OpExp: case OpLog: case OpIntPow:
+        case OpSin: case OpCos: case OpTanh: case OpSqrt:
+        case OpSigmoid: case OpSoftplus:
+            cross(deps[e.arg[0]], deps[e.arg[0]]);
+            break;
+        case OpSum:{
+            // Pattern of the term, moved to each index
+            DerivativeSparseHessian term(*e.term, e.term->numVariables());
+            const SparseMatrix<double>& P = term.matrix();
+            for(int li = e.ind;li < e.end;li++)
+                for(int lx = 0;lx < P.outerSize();lx++)
+                    for(SparseMatrix<double>::InnerIterator it(P, lx);it;++it){
+                        assert(li*e.stride + lx < x_size);
+                        adjacent[li*e.stride + lx].push_back(li*e.stride + it.row());
+                    }
+            break;
+        }
+        case OpConstant: case OpVariable: case OpLinear: case OpParameter:
+        case OpAdd: case OpSub: case OpAbs: case OpSign:
+            // Linear, or zero second order partial differential
+            break;
+        default:
+            assert(0 and "DerivativeSparseHessian meets unknown op code.");
+            break;
+        }
+    }
+
+    std::vector< Triplet<double> > pattern;
+    for(int lx = 0;lx < x_size;lx++){
+        std::vector<int>& adj = adjacent[lx];
+        std::sort(adj.begin(), adj.end());
+        adj.erase(std::unique(adj.begin(), adj.end()), adj.end());
+        for(int ly : adj)
+            pattern.push_back(Triplet<double>(ly, lx, 0));
+    }
+
+    // Symmetric, the rows of a column are its columns as well
+    num_colors = colorColumns(adjacent, adjacent, color);
+
+    H.resize(x_size, x_size);
+    H.setFromTriplets(pattern.begin(), pattern.end());
+    H.makeCompressed();
+
+    for(int lx = 0;lx < H.outerSize();lx++)
+        for(SparseMatrix<double>::InnerIterator it(H, lx);it;++it){
+            nz_row.push_back(it.row());
+            nz_color.push_back(color[lx]);
+        }
+}
+
+int DerivativeSparseHessian::numColors() const {
+    return num_colors;
+}
+
+const SparseMatrix<double>& DerivativeSparseHessian::compute(const DerivativeInput& x, const Ref<const VectorXd>& w, DerivativeWorkspace& ws){
+    assert(x.size() == H.cols());
+
+    ws.prod.resize(x.size(), num_colors);
+    tape.hessianSweep(x, w, color.data(), nullptr, num_colors, ws.prod, ws);
+
+    double* value = H.valuePtr();
+    for(int lz = 0;lz < (int)nz_row.size();lz++)
+        value[lz] = ws.prod(nz_row[lz], nz_color[lz]);
+
+    return H;
+}
+
+const SparseMatrix<double>& DerivativeSparseHessian::matrix() const {
+    return H;
+}
+
+
+DerivativeLagrangian::DerivativeLagrangian(const Derivative& f, const std::vector<Derivative>& hs):
+    tape([&f, &hs](){
+        std::vector<Derivative> roots(1, f);
+        roots.insert(roots.end(), hs.begin(), hs.end());
+        return roots;
+    }()){
+}
+
+int DerivativeLagrangian::numConstraints() const {
+    return tape.numOutputs() - 1;
+}
+
+VectorXd DerivativeLagrangian::weights(const VectorXd& y) const {
+    assert(y.size() == numConstraints());
+    VectorXd w(tape.numOutputs());
+    w[0] = 1;
+    w.tail(y.size()) = -y;
+    return w;
+}
+
+double DerivativeLagrangian::operator()(const VectorXd& x, const VectorXd& y) const {
+    return weights(y).dot(tape(x));
+}
+
+VectorXd DerivativeLagrangian::gradient(const VectorXd& x, const VectorXd& y) const {
+    return tape.gradient(x, weights(y));
+}
+
+MatrixXd DerivativeLagrangian::hessian(const VectorXd& x, const VectorXd& y) const {
+    return tape.hessian(x, weights(y));
+}
+
+
+DerivativeRecurrence::DerivativeRecurrence(const std::vector<Derivative>& F, const Derivative& G, int state_size):
+    step(F), objective({G}), d(state_size), forward_steps(0){
+    assert(step.numOutputs() == d);
+}
+
+void DerivativeRecurrence::advance(VectorXd& s, const VectorXd& x){
+    input << s, x;
+    step.evaluate(input, s, ws);
+    forward_steps++;
+}
+
+void DerivativeRecurrence::adjoint(const VectorXd& s, const VectorXd& x, VectorXd& lambda, VectorXd& gx){
+    input << s, x;
+    step.gradient(input, lambda, grad, ws);
+    lambda = grad.head(d);
+    gx += grad.tail(x.size());
+}
+
+void DerivativeRecurrence::reverse(int a, int b, const VectorXd& sa, int c, const VectorXd& x, VectorXd& lambda, VectorXd& gx){
+    // Enough memory for every state
+    if(c >= b - a - 1){
+        std::vector<VectorXd> states(1, sa);
+        for(int lk = a + 1;lk < b;lk++){
+            states.push_back(states.back());
+            advance(states.back(), x);
+        }
+        for(int lk = b-1;lk >= a;lk--)
+            adjoint(states[lk - a], x, lambda, gx);
+        return;
+    }
+
+    // The first part goes on in the loop rather than recursion, so the depth
+    // is bounded by c.
+    while(b - a > 1 and c > 0){
+        // Smallest t such that C(c+t, c) steps can be reversed by c
+        // checkpoints and t repeats. The part after m has at most C(c-1+t, c-1)
+        // steps and the part before it at most C(c+t-1, c).
+        int l = b - a, t = 0;
+        auto binomial = [](int n, int k){
+            double ret = 1;
+            for(int li = 1;li <= k;li++)
+                ret = ret*(n - k + li)/li;
+            return ret;
+        };
+        while(binomial(c + t, c) < l)
+            t++;
+        int m = b - (int)std::min<double>(l - 1, binomial(c - 1 + t, c - 1));
+
+        {
+            VectorXd sm = sa;
+            for(int lk = a;lk < m;lk++)
+                advance(sm, x);
+            reverse(m, b, sm, c - 1, x, lambda, gx);
+        }
+        b = m;
+    }
+
+    // No checkpoint left, recompute each state from sa
+    VectorXd s;
+    for(int lk = b-1;lk >= a;lk--){
+        s = sa;
+        for(int li = a;li < lk;li++)
+            advance(s, x);
+        adjoint(s, x, lambda, gx);
+    }
+}
+
+double DerivativeRecurrence::operator()(const VectorXd& s0, const VectorXd& x, int steps){
+    assert(s0.size() == d);
+    input.resize(d + x.size());
+    forward_steps = 0;
+
+    VectorXd s = s0, J(1);
+    for(int lk = 0;lk < steps;lk++)
+        advance(s, x);
+
+    input << s, x;
+    objective.evaluate(input, J, ws);
+    return J[0];
+}
+
+double DerivativeRecurrence::gradient(const VectorXd& s0, const VectorXd& x, int steps, int checkpoints, Ref<VectorXd> g){
+    assert(g.size() == d + x.size());
+    assert(checkpoints >= 0);
+
+    double J = (*this)(s0, x, steps);
+
+    // Seed from G at the last state, which is still in input
+    grad.resize(d + x.size());
+    objective.gradient(input, VectorXd::Ones(1), grad, ws);
+    VectorXd lambda = grad.head(d), gx = grad.tail(x.size());
+
+    reverse(0, steps, s0, checkpoints, x, lambda, gx);
+
+    g << lambda, gx;
+    return J;
+}
+
+int DerivativeRecurrence::forwardSteps() const {
+    return forward_steps;
+}
+
+
+namespace{
+
+// Whether the graphs contain an opaque node, which DerivativeTape can't take
+bool containsOpaque(const std::vector<Derivative>& roots){
+    std::unordered_set<const DerivativeNode*> visited;
+    std::vector<ptrDerivativeNode> stack;
+    for(const Derivative& root : roots)
+        stack.push_back(root.inst);
+
+    while(not stack.empty()){
+        ptrDerivativeNode node = stack.back();
+        stack.pop_back();
+        if(visited.count(node.get()))
+            continue;
+        visited.insert(node.get());
+
+        if(node->numOperands() == 0){
+            DerivativeTapeEntry entry;
+            node->record(entry);
+            if(entry.op == OpOpaque)
+                return true;
+        }
+        for(int lk = 0;lk < node->numOperands();lk++)
+            stack.push_back(node->operand(lk));
+    }
+    return false;
+}
+
+} // namespace
+
+DerivativeImplicitSystem::DerivativeImplicitSystem(const std::shared_ptr<DerivativeImplicitSystem>& _parent, const std::vector<Derivative>& _residuals, const std::vector<int>& own_unknowns, const VectorXd& y0, double _tol):
+    parent(_parent), residuals(_residuals), tol(_tol), solved(false){
+    assert(own_unknowns.size() == (size_t)y0.size());
+    if(parent)
+        all_residuals = parent->all_residuals, unknowns = parent->unknowns;
+    own_begin = unknowns.size();
+    all_residuals.insert(all_residuals.end(), residuals.begin(), residuals.end());
+    unknowns.insert(unknowns.end(), own_unknowns.begin(), own_unknowns.end());
+
+    solution = VectorXd::Zero(unknowns.size());
+    solution.tail(y0.size()) = y0;
+
+    std::set<int> vars;
+    if(parent)
+        vars.insert(parent->outer.begin(), parent->outer.end());
+    for(const Derivative& r : residuals){
+        std::vector<int> r_vars = r.variables();
+        vars.insert(r_vars.begin(), r_vars.end());
+    }
+
+    width = parent ? parent->width : 0;
+    for(int v : vars)
+        width = std::max(width, v + 1);
+    for(int u : unknowns){
+        width = std::max(width, u + 1);
+        vars.erase(u);
+    }
+    outer.assign(vars.begin(), vars.end());
+
+    if(not containsOpaque(residuals))
+        tape = std::make_shared<DerivativeTape>(residuals);
+    else
+        for(Derivative r : residuals){
+            jacobian_graph.push_back(std::vector<Derivative>());
+            for(int u : own_unknowns)
+                jacobian_graph.back().push_back(r.diffPartial(u));
+        }
+}
+
+void DerivativeImplicitSystem::evaluate(const VectorXd& z, Ref<VectorXd> F){
+    if(tape)
+        tape->evaluate(z, F, ws);
+    else
+        for(int lr = 0;lr < (int)residuals.size();lr++)
+            F[lr] = residuals[lr](z);
+}
+
+void DerivativeImplicitSystem::jacobian(const VectorXd& z, Ref<MatrixXd> Jy){
+    int n = unknowns.size() - own_begin;
+    if(tape){
+        J.resize(residuals.size(), z.size());
+        tape->jacobian(z, J, ws);
+        for(int lu = 0;lu < n;lu++)
+            Jy.col(lu) = J.col(unknowns[own_begin + lu]);
+    }
+    else
+        for(int lr = 0;lr < (int)residuals.size();lr++)
+            for(int lu = 0;lu < n;lu++)
+                Jy(lr, lu) = jacobian_graph[lr][lu](z);
+}
+
+const VectorXd& DerivativeImplicitSystem::solve(const DerivativeInput& x){
+    if(solved and last_x.size() == x.size() and (last_x.array() == x.array()).all())
+        return result;
+
+    int m = residuals.size(), n = unknowns.size() - own_begin;
+    VectorXd z = VectorXd::Zero(std::max<int>(x.size(), width));
+    z.head(x.size()) = x;
+    if(parent)
+        solution.head(own_begin) = parent->solve(x);
+    for(int lu = 0;lu < (int)unknowns.size();lu++)
+        z[unknowns[lu]] = solution[lu];
+
+    // Gauss-Newton from the last solution, the step is halved until the
+    // residual decreases.
+    VectorXd F(m), F_new(m), z_new;
+    MatrixXd Jy(m, n);
+    evaluate(z, F);
+    for(int iter = 0;iter < 100 and F.norm() > 0;iter++){
+        jacobian(z, Jy);
+        VectorXd step = Jy.colPivHouseholderQr().solve(-F);
+
+        bool decreased = false;
+        double t = 1;
+        for(int lk = 0;lk < 30 and not decreased;lk++, t /= 2){
+            z_new = z;
+            for(int lu = 0;lu < n;lu++)
+                z_new[unknowns[own_begin + lu]] += t*step[lu];
+            evaluate(z_new, F_new);
+            decreased = F_new.norm() < F.norm();
+        }
+        if(not decreased)
+            break;
+
+        z.swap(z_new);
+        F.swap(F_new);
+        if(step.norm() <= 1e-14*(1 + solution.tail(n).norm()))
+            break;
+    }
+
+    // Also false if F or the parent's solution is NaN. The next x starts
+    // from the last solution found.
+    result = solution;
+    if(F.norm() <= tol){
+        for(int lu = own_begin;lu < (int)unknowns.size();lu++)
+            solution[lu] = z[unknowns[lu]];
+        result = solution;
+    }
+    else
+        result.tail(n).setConstant(std::numeric_limits<double>::quiet_NaN());
+
+    last_x = x;
+    solved = true;
+    return result;
+}
+
+std::shared_ptr<DerivativeImplicitSystem> DerivativeImplicitSystem::partialSystem(int index){
+    // Only the nodes own the extended systems, shared while they are alive
+    std::shared_ptr<DerivativeImplicitSystem> ret = partial[index].lock();
+    if(ret)
+        return ret;
+
+    // dy/dx[index] of unknown u is the variable width + u. Each residual r
+    // of the whole system gives
+    //   dr/dx[index] + Sum_u dr/dy[u] * dy[u]/dx[index] = 0
+    int n = unknowns.size();
+    std::vector<Derivative> d_residuals;
+    std::vector<int> d_unknowns;
+    for(int lu = 0;lu < n;lu++)
+        d_unknowns.push_back(width + lu);
+    for(Derivative r : all_residuals){
+        Derivative dr = r.diffPartial(index);
+        for(int lu = 0;lu < n;lu++)
+            dr = dr + r.diffPartial(unknowns[lu])*Derivative::Variable(width + lu);
+        d_residuals.push_back(dr);
+    }
+
+    ret = std::make_shared<DerivativeImplicitSystem>(
+        shared_from_this(), d_residuals, d_unknowns, VectorXd::Zero(n), tol
+    );
+    partial[index] = ret;
+    return ret;
+}
+
+int DerivativeImplicitSystem::numUnknowns() const {
+    return unknowns.size();
+}
+
+const std::vector<int>& DerivativeImplicitSystem::outerVariables() const {
+    return outer;
+}
+
+int DerivativeImplicitSystem::unknown(int k) const {
+    return unknowns[k];
+}
+
+
+DerivativeImplicitNode::DerivativeImplicitNode(const std::shared_ptr<DerivativeImplicitSystem>& _system, int _k):
+    system(_system), k(_k){
+}
+
+ptrDerivativeNode DerivativeImplicitNode::_diffPartial(int index){
+    const std::vector<int>& outer = system->outerVariables();
+    if(not std::binary_search(outer.begin(), outer.end(), index))
+        return ptrDerivativeNode(new ConstantDerivativeNode(0));
+
+    // Same unknown in the extended system, after all the unknowns of this one
+    return ptrDerivativeNode(new DerivativeImplicitNode(system->partialSystem(index), system->numUnknowns() + k));
+}
+
+double DerivativeImplicitNode::call(const DerivativeInput& vec) const {
+    return system->solve(vec)[k];
+}
+
+void DerivativeImplicitNode::print(std::ostream& stream) const {
+    stream << "Root(x[" << system->unknown(k) << "])";
+    return;
+}
+
+void DerivativeImplicitNode::record(DerivativeTapeEntry& entry) const {
+    entry.op = OpOpaque;
+}
+
+const std::vector<int>& DerivativeImplicitNode::variables() const {
+    return system->outerVariables();
+}
+
+
+DerivativeBoundNode::DerivativeBoundNode(const ptrDerivativeNode& _node, const std::vector<int>& _source, const VectorXd& _value):
+    node(_node), source(_source), value(_value){
+    assert(source.size() == (size_t)value.size());
+}
+
+ptrDerivativeNode DerivativeBoundNode::_diffPartial(int index){
+    ptrDerivativeNode ret(new ConstantDerivativeNode(0));
+    for(int lx = 0;lx < (int)source.size();lx++){
+        if(source[lx] != index)
+            continue;
+
+        ptrDerivativeNode d = node->diffPartial(lx);
+        if(not d->isConstant(0))
+            ret = newDerivativeAddNode(ret, ptrDerivativeNode(new DerivativeBoundNode(d, source, value)));
+    }
+    return ret;
+}
+
+double DerivativeBoundNode::call(const DerivativeInput& vec) const {
+    VectorXd z = value;
+    for(int lx = 0;lx < (int)source.size();lx++)
+        if(source[lx] >= 0)
+            z[lx] = vec[source[lx]];
+    return node->call(z);
+}
+
+void DerivativeBoundNode::print(std::ostream& stream) const {
+    stream << "Bound(";
+    node->print(stream);
+    for(int lx = 0;lx < (int)source.size();lx++)
+        if(source[lx] < 0)
+            stream << ", x[" << lx << "] = " << value[lx];
+        else if(source[lx] != lx)
+            stream << ", x[" << lx << "] = x[" << source[lx] << "]";
+    stream << ")";
+    return;
+}
+
+void DerivativeBoundNode::record(DerivativeTapeEntry& entry) const {
+    entry.op = OpOpaque;
+}
+
+std::vector<int> DerivativeBoundNode::variables() const {
+    std::set<int> ret;
+    for(int lx : Derivative(node).variables())
+        if(lx < (int)source.size() and source[lx] >= 0)
+            ret.insert(source[lx]);
+    return std::vector<int>(ret.begin(), ret.end());
+}
+
+std::vector<Derivative> implicitRoot(const std::vector<Derivative>& residuals, const std::vector<int>& unknowns, const VectorXd& y0, double tol){
+    std::shared_ptr<DerivativeImplicitSystem> system = std::make_shared<DerivativeImplicitSystem>(
+        nullptr, residuals, unknowns, y0, tol
+    );
+
+    std::vector<Derivative> ret;
+    for(int lu = 0;lu < (int)unknowns.size();lu++)
+        ret.push_back(Derivative(ptrDerivativeNode(new DerivativeImplicitNode(system, lu))));
+    return ret;
+}
+
+std::vector<Derivative> implicitArgmin(const Derivative& objective, const std::vector<int>& unknowns, const VectorXd& y0, double tol){
+    Derivative f = objective;
+    std::vector<Derivative> gradient;
+    for(int u : unknowns)
+        gradient.push_back(f.diffPartial(u));
+    return implicitRoot(gradient, unknowns, y0, tol);
+}
+
+
+namespace{
+
+// Roots of the Lagrangian's tape, the objective first
+std::vector<Derivative> lagrangianRoots(const Derivative& f, const std::vector<Derivative>& hs){
+    std::vector<Derivative> roots(1, f);
+    roots.insert(roots.end(), hs.begin(), hs.end());
+    return roots;
+}
+
+// Largest step in (0, 1] keeping v + step*dv >= (1 - tau)*v for positive v
+double stepToBoundary(const VectorXd& v, const VectorXd& dv, double tau){
+    double step = 1;
+    for(int lx = 0;lx < v.size();lx++)
+        if(dv[lx] < 0)
+            step = std::min(step, -tau*v[lx]/dv[lx]);
+    return step;
+}
+
+} // namespace
+
+DerivativeIPM::DerivativeIPM(const Derivative& f, const std::vector<Derivative>& hs, int _x_size):
+    x_size(_x_size), h_size(hs.size()),
+    f_tape({f}), h_tape(hs),
+    jac(h_tape, _x_size), hess(DerivativeTape(lagrangianRoots(f, hs)), _x_size),
+    delta(0), iters(0), status(NoConvergence){
+
+    // Lower triangle of the KKT system, the diagonal is always kept for the
+    // regularization.
+    int n = x_size + h_size;
+    std::vector< Triplet<double> > pattern;
+    const SparseMatrix<double>& H = hess.matrix();
+    const SparseMatrix<double>& A = jac.matrix();
+
+    for(int lx = 0;lx < H.outerSize();lx++)
+        for(SparseMatrix<double>::InnerIterator it(H, lx);it;++it)
+            if(it.row() >= lx)
+                pattern.push_back(Triplet<double>(it.row(), lx, 0));
+    for(int lx = 0;lx < A.outerSize();lx++)
+        for(SparseMatrix<double>::InnerIterator it(A, lx);it;++it)
+            pattern.push_back(Triplet<double>(x_size + it.row(), lx, 0));
+    for(int lx = 0;lx < n;lx++)
+        pattern.push_back(Triplet<double>(lx, lx, 0));
+
+    kkt.resize(n, n);
+    kkt.setFromTriplets(pattern.begin(), pattern.end());
+    kkt.makeCompressed();
+
+    // The entries exist, coeffRef doesn't insert
+    auto position = [&](int row, int col){
+        return (int)(&kkt.coeffRef(row, col) - kkt.valuePtr());
+    };
+
+    for(int lx = 0;lx < H.outerSize();lx++)
+        for(SparseMatrix<double>::InnerIterator it(H, lx);it;++it)
+            hess_pos.push_back(it.row() >= lx ? position(it.row(), lx) : -1);
+    for(int lx = 0;lx < A.outerSize();lx++)
+        for(SparseMatrix<double>::InnerIterator it(A, lx);it;++it)
+            jac_pos.push_back(position(x_size + it.row(), lx));
+    for(int lx = 0;lx < x_size;lx++)
+        diag_pos.push_back(position(lx, lx));
+    for(int lh = 0;lh < h_size;lh++)
+        slack_pos.push_back(position(x_size + lh, x_size + lh));
+
+    ldlt.analyzePattern(kkt);
+}
+
+bool DerivativeIPM::factorize(const VectorXd& x, const VectorXd& y, const VectorXd& w){
+    VectorXd weight(h_size + 1);
+    weight << 1, -y;
+
+    const SparseMatrix<double>& H = hess.compute(x, weight, ws);
+    const SparseMatrix<double>& A = jac.compute(x, ws);
+
+    double* value = kkt.valuePtr();
+    std::fill(value, value + kkt.nonZeros(), 0.0);
+    for(int lz = 0;lz < (int)hess_pos.size();lz++)
+        if(hess_pos[lz] >= 0)
+            value[hess_pos[lz]] = -H.valuePtr()[lz];
+    for(int lz = 0;lz < (int)jac_pos.size();lz++)
+        value[jac_pos[lz]] = A.valuePtr()[lz];
+    for(int lh = 0;lh < h_size;lh++)
+        value[slack_pos[lh]] = w[lh]/y[lh];
+
+    VectorXd diag(x_size);
+    for(int lx = 0;lx < x_size;lx++)
+        diag[lx] = value[diag_pos[lx]];
+
+    // Try without regularization first, then start from a fraction of the
+    // last delta and raise it until the inertia is right.
+    double d = 0;
+    for(;;){
+        for(int lx = 0;lx < x_size;lx++)
+            value[diag_pos[lx]] = diag[lx] - d;
+
+        ldlt.factorize(kkt);
+        if(ldlt.info() == Success){
+            const VectorXd& D = ldlt.vectorD();
+            if((D.array() < 0).count() == x_size and (D.array() != 0).all()){
+                if(d > 0)
+                    delta = d;
+                return true;
+            }
+        }
+
+        if(d == 0)
+            d = delta > 0 ? std::max(1e-20, delta/3) : 1e-4;
+        else
+            d *= delta > 0 ? 8 : 100;
+
+        if(d > 1e40)
+            return false;
+    }
+}
+
+VectorXd DerivativeIPM::solve(const VectorXd& x0, int max_iter, double tol){
+    assert(x0.size() == x_size);
+
+    VectorXd x = x0, h(h_size), g(x_size);
+    VectorXd one = VectorXd::Ones(1);
+
+    // Start from the interior, the slack might not satisfy h(x) = w yet
+    h_tape.evaluate(x, h, ws);
+    VectorXd w = h.cwiseMax(1e-2), y = VectorXd::Ones(h_size);
+
+    VectorXd rhs(x_size + h_size);
+    delta = 0;
+    status = NoConvergence;
+
+    for(iters = 0;iters < max_iter;){
+        double gap = h_size ? w.dot(y)/h_size : 0, mu = 0.1*gap;
+
+        h_tape.evaluate(x, h, ws);
+        f_tape.gradient(x, one, g, ws);
+
+        if(not factorize(x, y, w)){
+            status = NumericalIssue;
+            break;
+        }
+
+        const SparseMatrix<double>& A = jac.matrix();
+        rhs << g - A.transpose()*y,
+               -h + mu*y.cwiseInverse();
+
+        VectorXd dxy = ldlt.solve(rhs);
+        VectorXd dx = dxy.head(x_size), dy = dxy.tail(h_size);
+        VectorXd dw = mu*y.cwiseInverse() - w - w.cwiseQuotient(y).cwiseProduct(dy);
+
+        double primal = stepToBoundary(w, dw, 0.995),
+               dual = stepToBoundary(y, dy, 0.995);
+
+        x += primal*dx, w += primal*dw, y += dual*dy;
+        iters++;
+
+        // Stop the diverged run as well
+        if(not x.allFinite())
+            break;
+        if(dx.lpNorm<Infinity>() <= tol and gap <= tol){
+            status = Success;
+            break;
+        }
+    }
+
+    return x;
+}
+
+int DerivativeIPM::iterations() const {
+    return iters;
+}
+
+ComputationInfo DerivativeIPM::info() const {
+    return status;
 }
 
 } // namespace Eigen
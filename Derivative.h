@@ -2,19 +2,66 @@
 #define DERIVATIVE_H_
 
 #include <Eigen/Dense>
+#include <Eigen/Sparse>
 #include <iostream>
 #include <memory> 
 #include <map>
+#include <vector>
+#include <string>
+#include <functional>
 
 //using Eigen::VectorXd;
 
 namespace Eigen{
 
 class DerivativeNode;
+class Derivative;
+class DerivativeTape;
+struct DerivativeWorkspace;
 
 // Use std's shared pointer
 typedef std::shared_ptr<DerivativeNode> ptrDerivativeNode;
 
+// Point to evaluate at. VectorXd, Map, matrix column and strided view are
+// all accepted without copy.
+typedef Ref<const VectorXd, 0, InnerStride<> > DerivativeInput;
+
+
+// Operation code of a node once it is flattened onto a DerivativeTape.
+// OpSum is the leaf of a DerivativeSumNode, which loops the tape of its term.
+// OpOpaque is a leaf without a tape op, such as DerivativeImplicitNode. The
+// graph passes take it by call and diffPartial of the node, and
+// DerivativeTape asserts on it.
+enum DerivativeOpCode{
+    OpConstant, OpVariable, OpLinear, OpParameter,
+    OpAdd, OpSub, OpMultiply, OpDivide,
+    OpPow, OpExp, OpLog,
+    OpIntPow, OpSin, OpCos, OpTanh, OpSqrt,
+    OpSigmoid, OpSoftplus, OpAbs, OpSign,
+    OpSum, OpOpaque
+};
+
+
+// One node of the graph on a DerivativeTape. Operands are refered by their
+// slot on the tape, which is always smaller than the slot of the entry.
+struct DerivativeTapeEntry{
+    DerivativeOpCode op;
+    int arg[2];
+    // Index of variable or parameter, exponent of integer pow, or slot of
+    // the Cos or Sin of the same operand
+    int ind;
+    // Value of constant, or exponent of pow
+    double p;
+    // Coefficient of linear function
+    VectorXd v;
+    // Sum of the tape term over i in [ind, end), its x[j] is x[i*stride + j].
+    // sub is its own workspace in DerivativeWorkspace::sub.
+    std::shared_ptr<const DerivativeTape> term;
+    int end, stride, sub;
+
+    DerivativeTapeEntry();
+};
+
 
 // DerivativeNode is the base class of all the class that can do partial
 // differential. It would not be used directively.
@@ -23,19 +70,52 @@ typedef std::shared_ptr<DerivativeNode> ptrDerivativeNode;
 // 1. _diffPartial: Do partial differential.
 // 2. call: As a scalar function, calculate the value and return.
 // 3. print: Use ostream to output.
+// And numOperands, operand, record to be flattened onto DerivativeTape.
+//
+// A node must not use itself in its partial differential: dp_map would
+// make the node own itself and it would never be freed. Nodes whose partial
+// differential is in terms of their own value build a copy from the operand,
+// so calling the partial differential evaluates the function again. Only
+// the sweeps of DerivativeTape reuse the value of the entry.
 class DerivativeNode{
 private:
     // Save the calculated partial differential node to save time. 
     std::map<int, ptrDerivativeNode> dp_map;
 
+    // Save the mixed partial differential by sorted multi-index, so the
+    // different order of the same indices share one node.
+    std::map<std::vector<int>, ptrDerivativeNode> mp_map;
+
 public:
     DerivativeNode(){}
     ptrDerivativeNode diffPartial(int index);
 
+    // Mixed partial differential, indices should be sorted and not empty.
+    ptrDerivativeNode diffPartial(const std::vector<int>& indices);
+
     virtual ptrDerivativeNode _diffPartial(int index);
-    virtual double call(const VectorXd& vec) const;
+    virtual double call(const DerivativeInput& vec) const;
+
+    // Node with operands implements printNode, which writes its operands by
+    // printOperand(k), so the printer decides how an operand is shown.
     virtual void print(std::ostream& stream) const;
+    virtual void printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const;
     virtual bool isConstant(double c) const; 
+
+    // Used by DerivativeTape to flatten the graph: the operands of the node,
+    // and record op code and parameters into the entry.
+    virtual int numOperands() const;
+    virtual ptrDerivativeNode operand(int k) const;
+    virtual void record(DerivativeTapeEntry& entry) const;
+
+    // The same function of the new operands, used by bind.
+    virtual ptrDerivativeNode rebuild(const std::vector<ptrDerivativeNode>& operands) const;
+
+    // Partial differential with respect to the k-th operand, in terms of the
+    // operands. Used by the symbolic reverse sweep.
+    virtual ptrDerivativeNode operandPartial(int k);
+
+    friend class Derivative;
 };
 
 
@@ -47,11 +127,12 @@ private:
 
 public:
     ConstantDerivativeNode(double _a);
-    
+
     ptrDerivativeNode _diffPartial(int index);
-    double call(const VectorXd& vec) const; 
+    double call(const DerivativeInput& vec) const; 
     void print(std::ostream& stream) const; 
     bool isConstant(double c) const;
+    void record(DerivativeTapeEntry& entry) const;
 };
 
 
@@ -64,10 +145,31 @@ private:
 
 public:
     VariableDerivativeNode(int _ind);
-    
+
     ptrDerivativeNode _diffPartial(int index);
-    double call(const VectorXd& vec) const; 
+    double call(const DerivativeInput& vec) const; 
     void print(std::ostream& stream) const;
+    void record(DerivativeTapeEntry& entry) const;
+};
+
+
+// Parameter of a residual template, such as one column of the observed
+// data. It is a constant to the partial differential, and its value comes
+// from DerivativeWorkspace::param when evaluated by DerivativeTape.
+// Sample usage:
+//   ptrDerivateNode obs(ParameterDerivativeNode(0));
+class ParameterDerivativeNode : public DerivativeNode{
+private:
+    // The index of parameter
+    int ind;
+
+public:
+    ParameterDerivativeNode(int _ind);
+
+    ptrDerivativeNode _diffPartial(int index);
+    double call(const DerivativeInput& vec) const; 
+    void print(std::ostream& stream) const;
+    void record(DerivativeTapeEntry& entry) const;
 };
 
 
@@ -83,8 +185,9 @@ public:
     LinearDerivativeNode(VectorXd _v);
 
     ptrDerivativeNode _diffPartial(int index);
-    double call(const VectorXd& vec) const;
+    double call(const DerivativeInput& vec) const;
     void print(std::ostream& stream) const;
+    void record(DerivativeTapeEntry& entry) const;
 };
 
 
@@ -96,8 +199,14 @@ public:
     DerivativeAddNode(const ptrDerivativeNode& _a, const ptrDerivativeNode& _b);
 
     ptrDerivativeNode _diffPartial(int index);
-    double call(const VectorXd& vec) const;
-    void print(std::ostream& stream) const;
+    double call(const DerivativeInput& vec) const;
+    void printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const;
+
+    int numOperands() const;
+    ptrDerivativeNode operand(int k) const;
+    void record(DerivativeTapeEntry& entry) const;
+    ptrDerivativeNode rebuild(const std::vector<ptrDerivativeNode>& operands) const;
+    ptrDerivativeNode operandPartial(int k);
 };
 
 
@@ -109,8 +218,14 @@ public:
     DerivativeSubNode(const ptrDerivativeNode& _a, const ptrDerivativeNode& _b);
 
     ptrDerivativeNode _diffPartial(int index);
-    double call(const VectorXd& vec) const;
-    void print(std::ostream& stream) const;
+    double call(const DerivativeInput& vec) const;
+    void printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const;
+
+    int numOperands() const;
+    ptrDerivativeNode operand(int k) const;
+    void record(DerivativeTapeEntry& entry) const;
+    ptrDerivativeNode rebuild(const std::vector<ptrDerivativeNode>& operands) const;
+    ptrDerivativeNode operandPartial(int k);
 };
 
 
@@ -122,8 +237,14 @@ public:
     DerivativeMultiplyNode(const ptrDerivativeNode& _a, const ptrDerivativeNode& _b);
 
     ptrDerivativeNode _diffPartial(int index);
-    double call(const VectorXd& vec) const;
-    void print(std::ostream& stream) const;
+    double call(const DerivativeInput& vec) const;
+    void printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const;
+
+    int numOperands() const;
+    ptrDerivativeNode operand(int k) const;
+    void record(DerivativeTapeEntry& entry) const;
+    ptrDerivativeNode rebuild(const std::vector<ptrDerivativeNode>& operands) const;
+    ptrDerivativeNode operandPartial(int k);
 };
 
 
@@ -135,8 +256,14 @@ public:
     DerivativeDivideNode(const ptrDerivativeNode& _a, const ptrDerivativeNode& _b);
 
     ptrDerivativeNode _diffPartial(int index);
-    double call(const VectorXd& vec) const;
-    void print(std::ostream& stream) const;
+    double call(const DerivativeInput& vec) const;
+    void printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const;
+
+    int numOperands() const;
+    ptrDerivativeNode operand(int k) const;
+    void record(DerivativeTapeEntry& entry) const;
+    ptrDerivativeNode rebuild(const std::vector<ptrDerivativeNode>& operands) const;
+    ptrDerivativeNode operandPartial(int k);
 };
 
 
@@ -149,8 +276,14 @@ public:
     DerivativePowNode(const ptrDerivativeNode& _a, double _p);
 
     ptrDerivativeNode _diffPartial(int index);
-    double call(const VectorXd& vec) const;
-    void print(std::ostream& stream) const;
+    double call(const DerivativeInput& vec) const;
+    void printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const;
+
+    int numOperands() const;
+    ptrDerivativeNode operand(int k) const;
+    void record(DerivativeTapeEntry& entry) const;
+    ptrDerivativeNode rebuild(const std::vector<ptrDerivativeNode>& operands) const;
+    ptrDerivativeNode operandPartial(int k);
 };
 
 
@@ -158,13 +291,21 @@ public:
 class DerivativeExpNode : public DerivativeNode{
 private:
     ptrDerivativeNode a;
+    // Exp(f(x)) again for the partial differential, built when first needed
+    ptrDerivativeNode copy_a;
 
 public:
     DerivativeExpNode(const ptrDerivativeNode& _a);
 
     ptrDerivativeNode _diffPartial(int index);
-    double call(const VectorXd& vec) const;
-    void print(std::ostream& stream) const;
+    double call(const DerivativeInput& vec) const;
+    void printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const;
+
+    int numOperands() const;
+    ptrDerivativeNode operand(int k) const;
+    void record(DerivativeTapeEntry& entry) const;
+    ptrDerivativeNode rebuild(const std::vector<ptrDerivativeNode>& operands) const;
+    ptrDerivativeNode operandPartial(int k);
 };
 
 
@@ -177,8 +318,287 @@ public:
     DerivativeLogNode(const ptrDerivativeNode& _a);
 
     ptrDerivativeNode _diffPartial(int index);
-    double call(const VectorXd& vec) const;
+    double call(const DerivativeInput& vec) const;
+    void printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const;
+
+    int numOperands() const;
+    ptrDerivativeNode operand(int k) const;
+    void record(DerivativeTapeEntry& entry) const;
+    ptrDerivativeNode rebuild(const std::vector<ptrDerivativeNode>& operands) const;
+    ptrDerivativeNode operandPartial(int k);
+};
+
+
+// f(x)**n for integer n, calculated by multiplication only
+class DerivativeIntPowNode : public DerivativeNode{
+private:
+    ptrDerivativeNode a;
+    int n;
+
+public:
+    DerivativeIntPowNode(const ptrDerivativeNode& _a, int _n);
+
+    ptrDerivativeNode _diffPartial(int index);
+    double call(const DerivativeInput& vec) const;
+    void printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const;
+
+    int numOperands() const;
+    ptrDerivativeNode operand(int k) const;
+    void record(DerivativeTapeEntry& entry) const;
+    ptrDerivativeNode rebuild(const std::vector<ptrDerivativeNode>& operands) const;
+    ptrDerivativeNode operandPartial(int k);
+};
+
+
+// Sin(f(x)). Its partial differential shares one Cos node of the same
+// operand while it is alive, which is the one sincos returns.
+class DerivativeSinNode : public DerivativeNode{
+private:
+    ptrDerivativeNode a;
+    // Cos(f(x)), weak since the partial differential of Cos owns a Sin
+    std::weak_ptr<DerivativeNode> cos_a;
+
+public:
+    DerivativeSinNode(const ptrDerivativeNode& _a);
+
+    ptrDerivativeNode _diffPartial(int index);
+    double call(const DerivativeInput& vec) const;
+    void printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const;
+
+    int numOperands() const;
+    ptrDerivativeNode operand(int k) const;
+    void record(DerivativeTapeEntry& entry) const;
+    ptrDerivativeNode rebuild(const std::vector<ptrDerivativeNode>& operands) const;
+    ptrDerivativeNode operandPartial(int k);
+
+    friend std::pair<Derivative, Derivative> sincos(const Derivative& a);
+};
+
+
+// Cos(f(x)), the counterpart of DerivativeSinNode. Its partial
+// differential uses a new Sin, since the Sin of sincos may own this node
+// through its own partial differential.
+class DerivativeCosNode : public DerivativeNode{
+private:
+    ptrDerivativeNode a;
+
+public:
+    DerivativeCosNode(const ptrDerivativeNode& _a);
+
+    ptrDerivativeNode _diffPartial(int index);
+    double call(const DerivativeInput& vec) const;
+    void printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const;
+
+    int numOperands() const;
+    ptrDerivativeNode operand(int k) const;
+    void record(DerivativeTapeEntry& entry) const;
+    ptrDerivativeNode rebuild(const std::vector<ptrDerivativeNode>& operands) const;
+    ptrDerivativeNode operandPartial(int k);
+};
+
+
+// Tanh(f(x)), its partial differential reuses a copy of the node
+class DerivativeTanhNode : public DerivativeNode{
+private:
+    ptrDerivativeNode a;
+    // Tanh(f(x)) again for the partial differential, built when first needed
+    ptrDerivativeNode copy_a;
+
+public:
+    DerivativeTanhNode(const ptrDerivativeNode& _a);
+
+    ptrDerivativeNode _diffPartial(int index);
+    double call(const DerivativeInput& vec) const;
+    void printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const;
+
+    int numOperands() const;
+    ptrDerivativeNode operand(int k) const;
+    void record(DerivativeTapeEntry& entry) const;
+    ptrDerivativeNode rebuild(const std::vector<ptrDerivativeNode>& operands) const;
+    ptrDerivativeNode operandPartial(int k);
+};
+
+
+// Sqrt(f(x)), its partial differential reuses a copy of the node
+class DerivativeSqrtNode : public DerivativeNode{
+private:
+    ptrDerivativeNode a;
+    // Sqrt(f(x)) again for the partial differential, built when first needed
+    ptrDerivativeNode copy_a;
+
+public:
+    DerivativeSqrtNode(const ptrDerivativeNode& _a);
+
+    ptrDerivativeNode _diffPartial(int index);
+    double call(const DerivativeInput& vec) const;
+    void printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const;
+
+    int numOperands() const;
+    ptrDerivativeNode operand(int k) const;
+    void record(DerivativeTapeEntry& entry) const;
+    ptrDerivativeNode rebuild(const std::vector<ptrDerivativeNode>& operands) const;
+    ptrDerivativeNode operandPartial(int k);
+};
+
+
+// 1/(1 + Exp(-f(x))), its partial differential reuses a copy of the node
+class DerivativeSigmoidNode : public DerivativeNode{
+private:
+    ptrDerivativeNode a;
+    // Sigmoid(f(x)) again for the partial differential, built when first needed
+    ptrDerivativeNode copy_a;
+
+public:
+    DerivativeSigmoidNode(const ptrDerivativeNode& _a);
+
+    ptrDerivativeNode _diffPartial(int index);
+    double call(const DerivativeInput& vec) const;
+    void printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const;
+
+    int numOperands() const;
+    ptrDerivativeNode operand(int k) const;
+    void record(DerivativeTapeEntry& entry) const;
+    ptrDerivativeNode rebuild(const std::vector<ptrDerivativeNode>& operands) const;
+    ptrDerivativeNode operandPartial(int k);
+};
+
+
+// Log(1 + Exp(f(x))), evaluated without overflow
+class DerivativeSoftplusNode : public DerivativeNode{
+private:
+    ptrDerivativeNode a;
+    // Sigmoid(f(x)) shared by all the partial differential
+    ptrDerivativeNode sigmoid_a;
+
+public:
+    DerivativeSoftplusNode(const ptrDerivativeNode& _a);
+
+    ptrDerivativeNode _diffPartial(int index);
+    double call(const DerivativeInput& vec) const;
+    void printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const;
+
+    int numOperands() const;
+    ptrDerivativeNode operand(int k) const;
+    void record(DerivativeTapeEntry& entry) const;
+    ptrDerivativeNode rebuild(const std::vector<ptrDerivativeNode>& operands) const;
+    ptrDerivativeNode operandPartial(int k);
+};
+
+
+// |f(x)|, partial differential is taken as 0 at f(x) = 0 by Sign(f(x))
+class DerivativeAbsNode : public DerivativeNode{
+private:
+    ptrDerivativeNode a;
+
+public:
+    DerivativeAbsNode(const ptrDerivativeNode& _a);
+
+    ptrDerivativeNode _diffPartial(int index);
+    double call(const DerivativeInput& vec) const;
+    void printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const;
+
+    int numOperands() const;
+    ptrDerivativeNode operand(int k) const;
+    void record(DerivativeTapeEntry& entry) const;
+    ptrDerivativeNode rebuild(const std::vector<ptrDerivativeNode>& operands) const;
+    ptrDerivativeNode operandPartial(int k);
+};
+
+
+// -1, 0 or 1 by the sign of f(x)
+class DerivativeSignNode : public DerivativeNode{
+private:
+    ptrDerivativeNode a;
+
+public:
+    DerivativeSignNode(const ptrDerivativeNode& _a);
+
+    ptrDerivativeNode _diffPartial(int index);
+    double call(const DerivativeInput& vec) const;
+    void printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const;
+
+    int numOperands() const;
+    ptrDerivativeNode operand(int k) const;
+    void record(DerivativeTapeEntry& entry) const;
+    ptrDerivativeNode rebuild(const std::vector<ptrDerivativeNode>& operands) const;
+    ptrDerivativeNode operandPartial(int k);
+};
+
+
+// Sum of one term over a range of index, without a node for each term:
+//   Sum_{i=begin}^{end-1} term(x[i*stride + 0], x[i*stride + 1], ...)
+// x[j] in term stands for the offset j from i*stride. It is evaluated by a
+// loop over one tape of term, and the partial differential of x[k] only
+// builds the few terms containing x[k], as sums of a single index. It is a
+// leaf to the graph algorithms, recorded on DerivativeTape as OpSum, which
+// runs the same loop in each sweep, so no node or entry is made for each
+// term. The term must be one DerivativeTape takes. Sample usage:
+//   // Sum_i (x[i+1] - x[i]*x[i])^2
+//   Derivative f = sum(pow(x1 - x0*x0, 2), 0, n-1);
+class DerivativeSumNode : public DerivativeNode{
+private:
+    ptrDerivativeNode term;
+    int begin, end, stride;
+    // Tape of term, and the variables of term
+    std::shared_ptr<const DerivativeTape> tape;
+    std::vector<int> offsets;
+    // Tape of the partial differential of term by each offset
+    std::map<int, std::shared_ptr<const DerivativeTape> > partial_tape;
+
+public:
+    DerivativeSumNode(const ptrDerivativeNode& _term, int _begin, int _end, int _stride, std::shared_ptr<const DerivativeTape> _tape = nullptr);
+
+    ptrDerivativeNode _diffPartial(int index);
+    double call(const DerivativeInput& vec) const;
+    void print(std::ostream& stream) const;
+    void record(DerivativeTapeEntry& entry) const;
+
+    // The same sum with its variables moved by offset, no variable should go
+    // below 0. Used by bind.
+    ptrDerivativeNode shifted(int offset) const;
+
+    friend class Derivative;
+    friend std::vector<Derivative> bind(const std::vector<Derivative>& roots, const std::map<int, double>& values, bool renumber);
+};
+
+
+// Sparse polynomial Sum_t coef[t] * Prod_v x[vars[v]]**exps(t, v), built by
+// Derivative::polynomial. Evaluated by multivariate Horner over the terms
+// sorted by exponent, with one table of powers of each variable, and the
+// partial differential is a polynomial of lower degree. Graph algorithms
+// such as DerivativeTape see the Horner form as Add, Multiply and IntPow
+// nodes, built when first asked for.
+class DerivativePolynomialNode : public DerivativeNode{
+private:
+    std::vector<int> vars;
+    // Row t is the exponent of each variable in term t, in descending
+    // lexicographic order, so the terms with the same leading exponents are
+    // next to each other.
+    Matrix<int, Dynamic, Dynamic, RowMajor> exps;
+    VectorXd coef;
+    // Start of the powers of each variable in the power table
+    std::vector<int> power_begin;
+    mutable ptrDerivativeNode horner_form;
+
+    double horner(const double* power, int lo, int hi, int v) const;
+    ptrDerivativeNode hornerNode(const std::vector<std::vector<ptrDerivativeNode> >& power, int lo, int hi, int v) const;
+    ptrDerivativeNode hornerForm() const;
+
+public:
+    DerivativePolynomialNode(const std::vector<int>& _vars, const Matrix<int, Dynamic, Dynamic, RowMajor>& _exps, const VectorXd& _coef);
+
+    ptrDerivativeNode _diffPartial(int index);
+    double call(const DerivativeInput& vec) const;
     void print(std::ostream& stream) const;
+    void printNode(std::ostream& stream, const std::function<void(int)>& printOperand) const;
+
+    int numOperands() const;
+    ptrDerivativeNode operand(int k) const;
+    void record(DerivativeTapeEntry& entry) const;
+    ptrDerivativeNode rebuild(const std::vector<ptrDerivativeNode>& operands) const;
+    ptrDerivativeNode operandPartial(int k);
+
+    friend class Derivative;
 };
 
 
@@ -188,18 +608,631 @@ public:
     ptrDerivativeNode inst;
     Derivative(ptrDerivativeNode _inst = nullptr);
     Derivative(double x);
-    
+
     // Useful in demo ... 
     static Derivative Variable(int ind);
 
+    // Parameter of a template. A graph with it is only evaluated by
+    // DerivativeTape, which takes the values of the parameters: operator()
+    // of it or of its partial differential asserts, and is NaN without
+    // assert.
+    static Derivative Parameter(int ind);
+
     Derivative diffPartial(int index);
-    double operator()(const VectorXd& vec) const;
+
+    // Mixed partial differential, the order of indices doesn't matter and
+    // each distinct one is built only once. Sample usage:
+    //   Derivative fxyy = f.diffPartial({1, 0, 1});
+    Derivative diffPartial(std::vector<int> indices);
+
+    // All the partial differential of the order which are not constant zero,
+    // keyed by sorted multi-index.
+    std::map<std::vector<int>, Derivative> diffPartials(int order);
+
+    // Sorted index of variables the function depends on
+    std::vector<int> variables() const;
+
+    // All the partial differential up to x_size by one symbolic reverse
+    // sweep, as one graph of size a constant multiple of this one. A leaf
+    // without a tape op of its own is taken by its diffPartial. Though const,
+    // it caches the results in the root node as its partial differential, so
+    // diffPartial returns the same nodes afterwards. Sample usage:
+    //   std::vector<Derivative> grad = f.gradientGraph(n);
+    //   Derivative fxy = grad[0].diffPartial(1);
+    std::vector<Derivative> gradientGraph(int x_size) const;
+
+    // Hessian times v at x by forward-over-reverse on a tape of the graph,
+    // without any second order partial differential node. Records the tape
+    // on each call, use DerivativeTape::hessianVectorProduct to repeat it.
+    VectorXd hessianVectorProduct(const DerivativeInput& x, const DerivativeInput& v) const;
+
+    double operator()(const DerivativeInput& vec) const;
+
+    // Evaluate on a raw buffer, variable i is x[i*stride]
+    double operator()(const double* x, int size, int stride = 1) const;
+
+    // Print the nodes used more than once only once each, as bindings before
+    // the expression, so the output is linear in the size of the graph.
+    // Sample output of exp(x*y) + sin(x*y):
+    //   t1 = (x[0] * x[1]);
+    //   (Exp(t1) + Sin(t1))
+    void printShared(std::ostream& stream) const;
+
+    // printShared cut at max_size characters, ended by "..." if cut. Safe for
+    // logging a graph of any size.
+    std::string toString(size_t max_size) const;
+
+    // Substitute the bound variables by constants and fold the subtrees
+    // which become constant. With renumber, the remaining variables move down
+    // over the bound ones, e.g. binding x[1] turns x[2] into x[1]. Sample
+    // usage:
+    //   Derivative g = f.bind({{1, 0.5}, {3, 2.0}}, true);
+    Derivative bind(const std::map<int, double>& values, bool renumber = false) const;
+
+    // Replace each largest polynomial subgraph, made of constants, variables,
+    // +, -, *, IntPow and division by constant, by a DerivativePolynomialNode.
+    // A subgraph whose expansion has more than max_terms terms is left as it
+    // is, with its polynomial operands converted. Sample usage:
+    //   // Poly(x[0]**2 + x[1]**2 - 1)
+    //   Derivative h = (x*x + y*y - 1).polynomial();
+    Derivative polynomial(int max_terms = 256) const;
 };
 
 
 std::ostream& operator<< (std::ostream& stream, const Derivative& a);
 
 
+// Buffers of DerivativeTape's sweeps, reused between calls. Don't share one
+// between threads.
+struct DerivativeWorkspace{
+    // Value and adjoint of each entry
+    VectorXd val, adj;
+    // First and second order partial differential of each entry with respect
+    // to its operands, d2 saves (aa, ab, bb).
+    MatrixXd d1, d2;
+    // Tangent and second order adjoint, one column for each entry
+    MatrixXd tan, adj2;
+    // Values at many points, one column for each entry
+    MatrixXd batch;
+
+    // Value of the Parameter nodes
+    VectorXd param;
+    // Residuals, Jacobian rows and data of one chunk of streaming evaluation
+    VectorXd res;
+    MatrixXd jac;
+    Matrix<double, Dynamic, Dynamic, RowMajor> data;
+
+    // Product of Hessian and the seed directions, one column for each
+    MatrixXd prod;
+
+    // Workspace of the term of each sum on the tape. In it, the gradient of
+    // one term or its values at many points, and its Hessian.
+    std::vector<DerivativeWorkspace> sub;
+    VectorXd term;
+    MatrixXd term_hess;
+};
+
+
+// Receives one chunk of streaming evaluation: index of its first row, and
+// the residuals and Jacobian rows of the chunk, row i output k at i*m + k.
+typedef std::function<void(int first, const Ref<const VectorXd>& r, const Ref<const MatrixXd>& J)> DerivativeChunkFunction;
+
+
+// Vectorized exp, log and pow of n values. Compiled for SSE4.1, AVX2 and
+// AVX-512 as well, and the CPU picks one at runtime. Sampled over the whole
+// range, the error is within 1 ulp for exp and log, and within 2 + |p|/7 ulp
+// for pow. Special values follow std::exp, std::log and std::pow.
+void batchExp(const double* in, double* out, int n);
+void batchLog(const double* in, double* out, int n);
+void batchPow(const double* in, double p, double* out, int n);
+
+
+// How DerivativeTape makes a constant of Scalar and evaluates elementary
+// functions on it. Coefficient is the type of a single lane. Specialize it
+// for the scalar type that can't be constructed from double.
+template<typename Scalar>
+struct DerivativeScalarTraits{
+    typedef Scalar Coefficient;
+    static Scalar constant(double c){ return Scalar(c); }
+    static Scalar exp(const Scalar& a){ return std::exp(a); }
+    static Scalar log(const Scalar& a){ return std::log(a); }
+    static Scalar pow(const Scalar& a, double p){ return std::pow(a, Scalar(p)); }
+    static Scalar sin(const Scalar& a){ return std::sin(a); }
+    static Scalar cos(const Scalar& a){ return std::cos(a); }
+    static Scalar tanh(const Scalar& a){ return std::tanh(a); }
+    static Scalar sqrt(const Scalar& a){ return std::sqrt(a); }
+    static Scalar abs(const Scalar& a){ return std::abs(a); }
+    static Scalar sign(const Scalar& a){ return Scalar((a > 0) - (a < 0)); }
+    static Scalar sigmoid(const Scalar& a){ return Scalar(1)/(Scalar(1) + std::exp(-a)); }
+
+    static Scalar softplus(const Scalar& a){
+        return std::max(a, Scalar(0)) + std::log1p(std::exp(-std::abs(a)));
+    }
+};
+
+// Elementary functions of Array by Eigen
+template<typename _Scalar, int _Rows>
+struct DerivativeArrayTraits{
+    typedef _Scalar Coefficient;
+    typedef Array<_Scalar, _Rows, 1> Lanes;
+    static Lanes constant(double c){ return Lanes::Constant(_Scalar(c)); }
+    static Lanes exp(const Lanes& a){ return a.exp(); }
+    static Lanes log(const Lanes& a){ return a.log(); }
+    static Lanes pow(const Lanes& a, double p){ return a.pow(_Scalar(p)); }
+    static Lanes sin(const Lanes& a){ return a.sin(); }
+    static Lanes cos(const Lanes& a){ return a.cos(); }
+    static Lanes tanh(const Lanes& a){ return a.tanh(); }
+    static Lanes sqrt(const Lanes& a){ return a.sqrt(); }
+    static Lanes abs(const Lanes& a){ return a.abs(); }
+
+    static Lanes sign(const Lanes& a){
+        return (a > 0).template cast<_Scalar>() - (a < 0).template cast<_Scalar>();
+    }
+
+    static Lanes sigmoid(const Lanes& a){ return (1 + (-a).exp()).inverse(); }
+
+    static Lanes softplus(const Lanes& a){
+        return a.max(_Scalar(0)) + (-a.abs()).exp().log1p();
+    }
+};
+
+template<typename _Scalar, int _Rows>
+struct DerivativeScalarTraits< Array<_Scalar, _Rows, 1> > : DerivativeArrayTraits<_Scalar, _Rows>{
+};
+
+// Lanes of double go through the vectorized kernels
+template<int _Rows>
+struct DerivativeScalarTraits< Array<double, _Rows, 1> > : DerivativeArrayTraits<double, _Rows>{
+    typedef Array<double, _Rows, 1> Lanes;
+
+    static Lanes exp(const Lanes& a){
+        Lanes ret(a.size());
+        batchExp(a.data(), ret.data(), a.size());
+        return ret;
+    }
+
+    static Lanes log(const Lanes& a){
+        Lanes ret(a.size());
+        batchLog(a.data(), ret.data(), a.size());
+        return ret;
+    }
+
+    static Lanes pow(const Lanes& a, double p){
+        Lanes ret(a.size());
+        batchPow(a.data(), p, ret.data(), a.size());
+        return ret;
+    }
+
+    static Lanes sigmoid(const Lanes& a){ return (1 + exp(-a)).inverse(); }
+
+    static Lanes softplus(const Lanes& a){
+        return a.max(0.0) + exp(-a.abs()).log1p();
+    }
+};
+
+
+// a**n by multiplication only
+template<typename Scalar>
+Scalar derivativeIntPow(const Scalar& a, int n){
+    typedef DerivativeScalarTraits<Scalar> Traits;
+    if(n < 0)
+        return Traits::constant(1)/derivativeIntPow(a, -n);
+
+    Scalar ret = Traits::constant(1), base = a;
+    for(;n > 0;n >>= 1){
+        if(n & 1)
+            ret = ret*base;
+        if(n > 1)
+            base = base*base;
+    }
+    return ret;
+}
+
+
+// The graphs of several Derivative flattened in topological order. Shared
+// nodes are recorded only once, and the tape doesn't refer to the graph after
+// it is built, so evaluating it never touches the nodes. Sample usage:
+//   DerivativeTape tape({f, g});
+//   VectorXd fg = tape(x);
+class DerivativeTape{
+private:
+    std::vector<DerivativeTapeEntry> entries;
+    // Slot of each output
+    std::vector<int> outputs;
+
+    friend class DerivativeSparseJacobian;
+    friend class DerivativeSparseHessian;
+
+    // Value of one entry from the values of the entries before it
+    template<typename Scalar, typename Input>
+    static Scalar apply(const DerivativeTapeEntry& e, const Input& x, const Scalar* val, const double* param);
+
+    // Workspace of the term of sum entry e, value of the sum, and its gradient
+    // times w added into g.
+    static DerivativeWorkspace& sumWorkspace(const DerivativeTapeEntry& e, DerivativeWorkspace& ws);
+    static double sumValue(const DerivativeTapeEntry& e, const DerivativeInput& x, DerivativeWorkspace& ws);
+    static void sumGradient(const DerivativeTapeEntry& e, const DerivativeInput& x, double w, Ref<VectorXd, 0, InnerStride<> > g, DerivativeWorkspace& ws);
+
+    // Tangent of sum entry e in the directions of hessianSweep, and its part
+    // of HS from adjoint adj and second order adjoint adj2.
+    static void sumTangent(const DerivativeTapeEntry& e, const DerivativeInput& x, const int* color, const double* seed, Ref<VectorXd> tan, DerivativeWorkspace& ws);
+    static void sumSecond(const DerivativeTapeEntry& e, const DerivativeInput& x, double adj, const Ref<const VectorXd>& adj2, const int* color, const double* seed, Ref<MatrixXd> HS, DerivativeWorkspace& ws);
+
+    // Calculate value, first and second order partial differential of every
+    // entry with respect to its operands into ws.
+    void forward(const DerivativeInput& x, DerivativeWorkspace& ws) const;
+
+    // Reverse sweep of adjoint seeded in ws.adj, after forward.
+    void reverse(const DerivativeInput& x, Ref<VectorXd, 0, InnerStride<> > g, DerivativeWorkspace& ws) const;
+
+    // Forward-over-reverse sweep of sum_k w[k]*f_k. Variable i seeds the
+    // direction color[i], or row i of seed, a column-major x.size() by
+    // directions matrix, or direction i if both are null. HS gets the
+    // Hessian times each direction, one column for each.
+    void hessianSweep(const DerivativeInput& x, const Ref<const VectorXd>& w, const int* color, const double* seed, int directions, Ref<MatrixXd> HS, DerivativeWorkspace& ws) const;
+
+    // Sorted index of variables each entry depends on
+    std::vector< std::vector<int> > dependency() const;
+
+    // Residuals and Jacobian rows of rows [first, first+rows) of data into
+    // ws.res and ws.jac, then hand them to f.
+    template<typename Data>
+    void evaluateChunk(const DerivativeInput& x, const Data& data, int first, int rows, const DerivativeChunkFunction& f, DerivativeWorkspace& ws) const;
+
+public:
+    DerivativeTape(const std::vector<Derivative>& roots);
+
+    int size() const;
+    int numOutputs() const;
+
+    // Largest index of variable read by the tape plus one
+    int numVariables() const;
+
+    // Value of every output. Scalar can be float, double, long double, or a
+    // fixed size Array whose coefficients are independent lanes, so one sweep
+    // evaluates several points. x[i] holds variable i, out must have
+    // numOutputs() entries, and param holds the Parameter nodes if any.
+    // Sample usage:
+    //   std::vector<Array4d> x(n), out(tape.numOutputs());
+    //   tape.evaluate(x.data(), out.data());
+    template<typename Scalar>
+    void evaluate(const Scalar* x, Scalar* out, const double* param = nullptr) const;
+
+    template<typename Scalar>
+    Matrix<Scalar, Dynamic, 1> operator()(const Matrix<Scalar, Dynamic, 1>& x) const;
+
+    // Write into the caller's buffers and keep the intermediate in ws. Once
+    // ws has been used on a tape with the same number of variables, these
+    // don't allocate any memory. Sample usage:
+    //   DerivativeWorkspace ws;
+    //   MatrixXd J(tape.numOutputs(), n);
+    //   for(...) tape.jacobian(x, J, ws);
+    void evaluate(const DerivativeInput& x, Ref<VectorXd> out, DerivativeWorkspace& ws) const;
+    void gradient(const DerivativeInput& x, const Ref<const VectorXd>& w, Ref<VectorXd> g, DerivativeWorkspace& ws) const;
+    void jacobian(const DerivativeInput& x, Ref<MatrixXd> J, DerivativeWorkspace& ws) const;
+    void hessian(const DerivativeInput& x, const Ref<const VectorXd>& w, Ref<MatrixXd> H, DerivativeWorkspace& ws) const;
+
+    // Hessian of sum_k w[k]*f_k times v, by one forward-over-reverse sweep
+    // along v. Costs a few gradients and never forms the Hessian. Sample
+    // usage, inside conjugate gradient:
+    //   tape.hessianVectorProduct(x, VectorXd::Ones(1), p, Hp, ws);
+    void hessianVectorProduct(const DerivativeInput& x, const Ref<const VectorXd>& w, const Ref<const VectorXd>& v, Ref<VectorXd> Hv, DerivativeWorkspace& ws) const;
+
+    // Value of every output at many points, one column of X for each point.
+    // All the points go through the tape together entry by entry, so exp,
+    // log and pow run on the vectorized kernels.
+    void evaluateBatch(const Ref<const MatrixXd>& X, Ref<MatrixXd> out, DerivativeWorkspace& ws) const;
+    MatrixXd evaluateBatch(const Ref<const MatrixXd>& X) const;
+
+    // Gradient of sum_k w[k]*f_k by one reverse sweep
+    VectorXd gradient(const DerivativeInput& x, const VectorXd& w) const;
+
+    // Jacobian of all the outputs, one reverse sweep for each output
+    MatrixXd jacobian(const DerivativeInput& x) const;
+
+    // Hessian of sum_k w[k]*f_k by one forward-over-reverse sweep, all the
+    // directions are carried together.
+    MatrixXd hessian(const DerivativeInput& x, const VectorXd& w) const;
+
+    // Stream a residual template over a dataset, parameter j of row i is
+    // data(i, j). At most chunk rows are held at once, so memory doesn't
+    // grow with the dataset. Sample usage:
+    //   MatrixXd JtJ = MatrixXd::Zero(n, n);
+    //   tape.evaluateRows(x, data, 4096, [&](int first, const Ref<const VectorXd>& r,
+    //                                        const Ref<const MatrixXd>& J){
+    //       JtJ.selfadjointView<Lower>().rankUpdate(J.transpose());
+    //   }, ws);
+    void evaluateRows(const DerivativeInput& x, const Ref<const MatrixXd>& data, int chunk, const DerivativeChunkFunction& f, DerivativeWorkspace& ws) const;
+
+    // Same as evaluateRows, over a binary file of row-major doubles with
+    // cols parameters in each row. It is read chunk by chunk and never held
+    // whole. Returns false if the file can't be read or isn't made of rows.
+    bool evaluateFile(const DerivativeInput& x, const std::string& path, int cols, int chunk, const DerivativeChunkFunction& f, DerivativeWorkspace& ws) const;
+};
+
+
+// Sparse Jacobian of the outputs of a tape. The pattern is found from the
+// graph once, and the columns that never share a row get the same color
+// (Curtis, Powell and Reid), so one forward sweep computes all the columns
+// of a color. compute only refreshes the values of the cached pattern.
+// Sample usage:
+//   DerivativeSparseJacobian sj(tape, x_size);
+//   for(...){
+//       const SparseMatrix<double>& J = sj.compute(x, ws);
+//       ...
+//   }
+class DerivativeSparseJacobian{
+private:
+    DerivativeTape tape;
+    // Color of each variable, -1 if no output depends on it
+    std::vector<int> color;
+    int num_colors;
+
+    SparseMatrix<double> J;
+    // Color and output slot of each stored nonzero
+    std::vector<int> nz_color, nz_slot;
+
+public:
+    DerivativeSparseJacobian(const DerivativeTape& _tape, int x_size);
+
+    int numColors() const;
+
+    const SparseMatrix<double>& compute(const DerivativeInput& x, DerivativeWorkspace& ws);
+
+    // Result of the last compute, or the pattern with zero values
+    const SparseMatrix<double>& matrix() const;
+};
+
+
+// Sparse Hessian of sum_k w[k]*f_k, the same way as DerivativeSparseJacobian.
+// The pattern comes from the nonlinear operations of the tape, and columns
+// are colored so that no two columns of a color share a row, then one
+// forward-over-reverse sweep carries a direction for each color.
+// Sample usage:
+//   DerivativeSparseHessian sh(tape, x_size);
+//   const SparseMatrix<double>& H = sh.compute(x, w, ws);
+class DerivativeSparseHessian{
+private:
+    DerivativeTape tape;
+    // Color of each variable, -1 if it has no second order term
+    std::vector<int> color;
+    int num_colors;
+
+    SparseMatrix<double> H;
+    // Row and color of the column of each stored nonzero
+    std::vector<int> nz_row, nz_color;
+
+public:
+    DerivativeSparseHessian(const DerivativeTape& _tape, int x_size);
+
+    int numColors() const;
+
+    const SparseMatrix<double>& compute(const DerivativeInput& x, const Ref<const VectorXd>& w, DerivativeWorkspace& ws);
+
+    // Result of the last compute, or the pattern with zero values
+    const SparseMatrix<double>& matrix() const;
+};
+
+
+// Lagrangian of the constrained problem
+//   min f(x)  sub  h_i(x) >= 0
+// L(x, y) = f(x) - sum_i y_i*h_i(x). The objective and the constraints share
+// one tape, so the Hessian of L is evaluated in a single sweep without
+// building any second order partial differential node. Sample usage:
+//   DerivativeLagrangian lag(f, {h1, h2});
+//   MatrixXd hess = lag.hessian(x, y);
+class DerivativeLagrangian{
+private:
+    DerivativeTape tape;
+
+    VectorXd weights(const VectorXd& y) const;
+
+public:
+    DerivativeLagrangian(const Derivative& f, const std::vector<Derivative>& hs);
+
+    int numConstraints() const;
+
+    double operator()(const VectorXd& x, const VectorXd& y) const;
+    VectorXd gradient(const VectorXd& x, const VectorXd& y) const;
+    MatrixXd hessian(const VectorXd& x, const VectorXd& y) const;
+};
+
+
+// Interior point method of
+//   min f(x)  sub  h_i(x) >= 0
+// for large sparse problems, with slack w and multiplier y as in
+// examples/interior-point-method.cpp. Each step solves the KKT system
+//   [ -(Hess + delta*I)  A^T      ] [dx]   [ grad f - A^T*y    ]
+//   [  A                 W*Y^(-1) ] [dy] = [ -h + mu*Y^(-1)*e  ]
+// kept in a sparse matrix of fixed pattern, by SimplicialLDLT whose symbolic
+// analysis is done once. delta is raised until the factorization has exactly
+// x_size negative pivots, i.e. the condensed matrix
+// Hess + delta*I + A^T*Y*W^(-1)*A is positive definite. w and y stay
+// positive by the fraction to boundary rule, and mu follows 0.1*w'y/m.
+// info() tells whether the last solve converged.
+// Sample usage:
+//   DerivativeIPM ipm(f, {h1, h2}, x_size);
+//   VectorXd x = ipm.solve(x0);
+class DerivativeIPM{
+private:
+    int x_size, h_size;
+    DerivativeTape f_tape, h_tape;
+    DerivativeSparseJacobian jac;
+    DerivativeSparseHessian hess;
+    DerivativeWorkspace ws;
+
+    SparseMatrix<double> kkt;
+    // Position in kkt's values of the lower Hessian, Jacobian, diagonal of
+    // Hessian and diagonal of W*Y^(-1)
+    std::vector<int> hess_pos, jac_pos, diag_pos, slack_pos;
+    SimplicialLDLT< SparseMatrix<double> > ldlt;
+
+    // Regularization of the last corrected step, the number of steps and
+    // the result of the last solve
+    double delta;
+    int iters;
+    ComputationInfo status;
+
+    // Assemble and factorize the KKT system at x, return false if no
+    // regularization works.
+    bool factorize(const VectorXd& x, const VectorXd& y, const VectorXd& w);
+
+public:
+    DerivativeIPM(const Derivative& f, const std::vector<Derivative>& hs, int _x_size);
+
+    VectorXd solve(const VectorXd& x0, int max_iter = 1000, double tol = 1e-6);
+
+    // Steps taken by the last solve
+    int iterations() const;
+
+    // Success if the last solve converged, NumericalIssue if the KKT system
+    // couldn't be factorized with the right inertia by any regularization,
+    // and NoConvergence if it ran out of steps or diverged.
+    ComputationInfo info() const;
+};
+
+
+// Gradient of a long recurrence
+//   s[k+1] = F(s[k], x)  for k = 0 .. steps-1,   J = G(s[steps], x)
+// given one step F instead of the unrolled graph. Variables 0 .. d-1 of F
+// and G are the state and the rest are x, F has d outputs and G has one.
+// The reverse sweep keeps at most checkpoints states besides s[0] and
+// recomputes the others from the nearest one, placed by the binomial
+// schedule of Revolve, so the number of recomputed steps is minimal for
+// the memory. Sample usage:
+//   DerivativeRecurrence rec({s0 + h*s0*(1 - s0)*a}, pow(s0 - 1, 2), 1);
+//   double J = rec.gradient(s0, x, 100000, 20, g);
+class DerivativeRecurrence{
+private:
+    DerivativeTape step, objective;
+    int d;
+    DerivativeWorkspace ws;
+    // Input of the tapes, and the gradient of one step
+    VectorXd input, grad;
+    int forward_steps;
+
+    // s = F(s, x)
+    void advance(VectorXd& s, const VectorXd& x);
+
+    // lambda and gx of step k from those of step k+1, at s = s[k]
+    void adjoint(const VectorXd& s, const VectorXd& x, VectorXd& lambda, VectorXd& gx);
+
+    // Reverse the steps [a, b) from state sa = s[a] with c checkpoints
+    void reverse(int a, int b, const VectorXd& sa, int c, const VectorXd& x, VectorXd& lambda, VectorXd& gx);
+
+public:
+    DerivativeRecurrence(const std::vector<Derivative>& F, const Derivative& G, int state_size);
+
+    double operator()(const VectorXd& s0, const VectorXd& x, int steps);
+
+    // J, with its gradient [dJ/ds0, dJ/dx] in g
+    double gradient(const VectorXd& s0, const VectorXd& x, int steps, int checkpoints, Ref<VectorXd> g);
+
+    // Steps of F evaluated by the last call, recomputation included
+    int forwardSteps() const;
+};
+
+
+// Residuals F(x, y) = 0 solved for the unknowns y as functions of the other
+// variables x, by Gauss-Newton with backtracking from the last solution.
+// Made by implicitRoot and shared by the DerivativeImplicitNode of each
+// unknown, so one x is solved only once. Differentiating by x[i] makes the
+// system extended by dy/dx[i], whose residuals are
+//   dF/dy * dy/dx[i] + dF/dx[i] = 0
+// over the solution of this one, so the partial differential of any order
+// comes from the implicit function theorem without the solver's iterations.
+// If the residual isn't within tol of 0 at the end, the solution is NaN.
+class DerivativeImplicitSystem : public std::enable_shared_from_this<DerivativeImplicitSystem>{
+private:
+    // Solved first, its unknowns are the first ones of this system. The
+    // extended systems own the one they extend, and not the reverse.
+    std::shared_ptr<DerivativeImplicitSystem> parent;
+    // The residuals of this system only, and all of them
+    std::vector<Derivative> residuals, all_residuals;
+    // Variable index of all the unknowns, and where this system's begin
+    std::vector<int> unknowns;
+    int own_begin;
+    // Sorted index of the variables which are x, and the number of variables
+    std::vector<int> outer;
+    int width;
+    double tol;
+
+    // Tape of the residuals, or null if they contain a DerivativeImplicitNode,
+    // then they are evaluated on the graph with the partial differential by
+    // the unknowns in jacobian_graph.
+    std::shared_ptr<DerivativeTape> tape;
+    std::vector< std::vector<Derivative> > jacobian_graph;
+    DerivativeWorkspace ws;
+    // Jacobian by all the variables on the tape
+    MatrixXd J;
+    // The last x, its result, and the last solution found to start from
+    VectorXd last_x, result, solution;
+    bool solved;
+
+    std::map<int, std::weak_ptr<DerivativeImplicitSystem> > partial;
+
+    // Residuals, and their Jacobian by this system's unknowns, at z
+    void evaluate(const VectorXd& z, Ref<VectorXd> F);
+    void jacobian(const VectorXd& z, Ref<MatrixXd> Jy);
+
+public:
+    DerivativeImplicitSystem(const std::shared_ptr<DerivativeImplicitSystem>& _parent, const std::vector<Derivative>& _residuals, const std::vector<int>& own_unknowns, const VectorXd& y0, double _tol);
+
+    // All the unknowns at x, the variables which are unknowns are ignored
+    const VectorXd& solve(const DerivativeInput& x);
+
+    // The system extended by the partial differential of all the unknowns
+    // by x[index], which go after the unknowns of this one.
+    std::shared_ptr<DerivativeImplicitSystem> partialSystem(int index);
+
+    int numUnknowns() const;
+    const std::vector<int>& outerVariables() const;
+    int unknown(int k) const;
+};
+
+
+// k-th unknown of a DerivativeImplicitSystem as a function of x. Its
+// variables are the x of the system. It supports call and diffPartial, and
+// can be in the residuals of another system. It is recorded as OpOpaque, so
+// DerivativeTape doesn't take it, and bind wraps it in a DerivativeBoundNode.
+// call solves the shared system, see implicitRoot for what that changes.
+class DerivativeImplicitNode : public DerivativeNode{
+private:
+    std::shared_ptr<DerivativeImplicitSystem> system;
+    int k;
+
+public:
+    DerivativeImplicitNode(const std::shared_ptr<DerivativeImplicitSystem>& _system, int _k);
+
+    ptrDerivativeNode _diffPartial(int index);
+    double call(const DerivativeInput& vec) const;
+    void print(std::ostream& stream) const;
+    void record(DerivativeTapeEntry& entry) const;
+
+    const std::vector<int>& variables() const;
+};
+
+
+// Opaque leaf node with some of its variables bound or moved by bind:
+// variable i of node is x[source[i]], or value[i] where source[i] is -1. It
+// is opaque as well, evaluated and differentiated through node.
+class DerivativeBoundNode : public DerivativeNode{
+private:
+    ptrDerivativeNode node;
+    std::vector<int> source;
+    VectorXd value;
+
+public:
+    DerivativeBoundNode(const ptrDerivativeNode& _node, const std::vector<int>& _source, const VectorXd& _value);
+
+    ptrDerivativeNode _diffPartial(int index);
+    double call(const DerivativeInput& vec) const;
+    void print(std::ostream& stream) const;
+    void record(DerivativeTapeEntry& entry) const;
+    std::vector<int> variables() const;
+};
+
+
 // Operator on Wrapper
 Derivative operator+(const Derivative& a, const Derivative& b);
 Derivative operator-(const Derivative& a, const Derivative& b);
@@ -208,6 +1241,130 @@ Derivative operator/(const Derivative& a, const Derivative& b);
 Derivative exp(const Derivative& a);
 Derivative log(const Derivative& a);
 Derivative pow(const Derivative& a, double p);
+Derivative sin(const Derivative& a);
+Derivative cos(const Derivative& a);
+Derivative tanh(const Derivative& a);
+Derivative sqrt(const Derivative& a);
+Derivative sigmoid(const Derivative& a);
+Derivative softplus(const Derivative& a);
+Derivative abs(const Derivative& a);
+
+// Sum of term over i in [begin, end), see DerivativeSumNode
+Derivative sum(const Derivative& term, int begin, int end, int stride = 1);
+
+// Sin and Cos of the same operand, the partial differential of the Sin
+// shares the Cos. DerivativeTape computes the two by one sincos.
+std::pair<Derivative, Derivative> sincos(const Derivative& a);
+
+// Derivative::bind for several functions, the subtrees they share stay
+// shared.
+std::vector<Derivative> bind(const std::vector<Derivative>& roots, const std::map<int, double>& values, bool renumber = false);
+
+// Root of residuals in the variables unknowns, as one function of the other
+// variables for each unknown, starting from y0. The unknowns shouldn't be
+// used as variables elsewhere. The unknowns are NaN where the residuals can't
+// be brought within tol of 0. Evaluating them, though const, warm starts
+// from and caches in the DerivativeImplicitSystem they share: they must not
+// be evaluated from several threads at once, and where the residuals have
+// several roots the one found depends on the x evaluated before. Sample
+// usage:
+//   // y(p) with y**3 + p*y - 1 = 0, p = x[0] and y = x[1]
+//   Derivative y = implicitRoot({pow(x1, 3) + x0*x1 - 1}, {1}, y0)[0];
+//   Derivative dydp = y.diffPartial(0);
+std::vector<Derivative> implicitRoot(const std::vector<Derivative>& residuals, const std::vector<int>& unknowns, const VectorXd& y0, double tol = 1e-8);
+
+// Stationary point of objective in the variables unknowns, the root of its
+// gradient by them.
+std::vector<Derivative> implicitArgmin(const Derivative& objective, const std::vector<int>& unknowns, const VectorXd& y0, double tol = 1e-8);
+
+
+template<typename Scalar, typename Input>
+Scalar DerivativeTape::apply(const DerivativeTapeEntry& e, const Input& x, const Scalar* val, const double* param){
+    typedef DerivativeScalarTraits<Scalar> Traits;
+    typedef typename Traits::Coefficient Coefficient;
+
+    switch(e.op){
+    case OpConstant:
+        return Traits::constant(e.p);
+    case OpVariable:
+        return x[e.ind];
+    case OpParameter:
+        assert(param and "DerivativeTape needs the value of parameter.");
+        return Traits::constant(param[e.ind]);
+    case OpLinear:{
+        Scalar ret = Traits::constant(0);
+        for(int lx = 0;lx < e.v.size();lx++)
+            ret += Coefficient(e.v[lx])*x[lx];
+        return ret;
+    }
+    case OpAdd:
+        return val[e.arg[0]] + val[e.arg[1]];
+    case OpSub:
+        return val[e.arg[0]] - val[e.arg[1]];
+    case OpMultiply:
+        return val[e.arg[0]] * val[e.arg[1]];
+    case OpDivide:
+        return val[e.arg[0]] / val[e.arg[1]];
+    case OpPow:
+        return Traits::pow(val[e.arg[0]], e.p);
+    case OpExp:
+        return Traits::exp(val[e.arg[0]]);
+    case OpLog:
+        return Traits::log(val[e.arg[0]]);
+    case OpIntPow:
+        return derivativeIntPow(val[e.arg[0]], e.ind);
+    case OpSin:
+        return Traits::sin(val[e.arg[0]]);
+    case OpCos:
+        return Traits::cos(val[e.arg[0]]);
+    case OpTanh:
+        return Traits::tanh(val[e.arg[0]]);
+    case OpSqrt:
+        return Traits::sqrt(val[e.arg[0]]);
+    case OpSigmoid:
+        return Traits::sigmoid(val[e.arg[0]]);
+    case OpSoftplus:
+        return Traits::softplus(val[e.arg[0]]);
+    case OpAbs:
+        return Traits::abs(val[e.arg[0]]);
+    case OpSign:
+        return Traits::sign(val[e.arg[0]]);
+    case OpSum:{
+        int width = e.term->numVariables();
+        std::vector<Scalar> segment(width);
+        Scalar ret = Traits::constant(0), term;
+        for(int li = e.ind;li < e.end;li++){
+            for(int lx = 0;lx < width;lx++)
+                segment[lx] = x[li*e.stride + lx];
+            e.term->evaluate(segment.data(), &term, param);
+            ret += term;
+        }
+        return ret;
+    }
+    case OpOpaque:
+        break;
+    }
+
+    assert(0 and "DerivativeTape meets unknown op code.");
+    return Traits::constant(0);
+}
+
+template<typename Scalar>
+void DerivativeTape::evaluate(const Scalar* x, Scalar* out, const double* param) const {
+    std::vector<Scalar> val(entries.size());
+    for(int lk = 0;lk < (int)entries.size();lk++)
+        val[lk] = apply<Scalar>(entries[lk], x, val.data(), param);
+
+    for(int lo = 0;lo < (int)outputs.size();lo++)
+        out[lo] = val[outputs[lo]];
+}
+
+template<typename Scalar>
+Matrix<Scalar, Dynamic, 1> DerivativeTape::operator()(const Matrix<Scalar, Dynamic, 1>& x) const {
+    Matrix<Scalar, Dynamic, 1> ret(outputs.size());
+    evaluate(x.data(), ret.data());
+    return ret;
+}
 
 } // namespace Eigen
 
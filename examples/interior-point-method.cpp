@@ -2,6 +2,10 @@
 #include <vector>
 #include <functional>
 #include <cmath>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <limits>
 #include <Eigen/Dense>
 
 #include "Derivative.h"
@@ -14,9 +18,10 @@ using Eigen::Derivative;
 using std::function;
 using std::vector;
 
-typedef function<double(VectorXd)> FuncDV;
-typedef function<VectorXd(VectorXd)> FuncVV;
-typedef function<MatrixXd(VectorXd)> FuncMV;
+typedef function<double(const VectorXd&)> FuncDV;
+typedef function<VectorXd(const VectorXd&)> FuncVV;
+typedef function<MatrixXd(const VectorXd&)> FuncMV;
+typedef function<MatrixXd(const VectorXd&, const VectorXd&)> FuncMVV;
 
 MatrixXd MakePositiveSemidefinite(MatrixXd mat, int dim){
     double left = 0, right = std::max(-mat.minCoeff(), .0) + 1;
@@ -34,11 +39,29 @@ MatrixXd MakePositiveSemidefinite(MatrixXd mat, int dim){
     return mat + right*MatrixXd::Identity(dim, dim);
 }
 
-VectorXd doIPM(
-    FuncDV F, FuncVV DelF, FuncMV LaplaceF,
-    FuncVV H, FuncMV DelH, vector<FuncMV> LaplaceH,
-    int dimX, int dimH, VectorXd initX
-){
+// Functions of the problem. They are only evaluated after being built, so
+// one IPMProblem is shared by the runs on all threads. This holds as long as
+// evaluating obj_f and con_hs changes nothing: sums keep their buffers per
+// thread, but an implicitRoot warm starts and caches in its system, so a
+// problem with one must not be shared.
+struct IPMProblem{
+    FuncDV F;
+    FuncVV DelF;
+    FuncVV H;
+    FuncMV DelH;
+    FuncMVV LaplaceL;
+    int dimX, dimH;
+};
+
+// Stop early if cancel is set by another thread
+VectorXd doIPM(const IPMProblem& problem, VectorXd initX, const std::atomic<bool>* cancel = nullptr){
+    const FuncDV& F = problem.F;
+    const FuncVV& DelF = problem.DelF;
+    const FuncVV& H = problem.H;
+    const FuncMV& DelH = problem.DelH;
+    const FuncMVV& LaplaceL = problem.LaplaceL;
+    int dimX = problem.dimX, dimH = problem.dimH;
+
     double mu = 0.0001;
 
     std::function<bool(VectorXd)> feasible = [dimH](VectorXd _f){
@@ -64,13 +87,14 @@ VectorXd doIPM(
         y = invA*DelF(x);
     }
     
-    for(;;){
+    for(int iter = 0;iter < 1000;iter++){
+        if(cancel and cancel->load())
+            break;
+
         VectorXd h = H(x), e = VectorXd::Ones(dimH);
         MatrixXd W = w.asDiagonal(), invY = y.asDiagonal().inverse();
 
-        MatrixXd Hess = LaplaceF(x);
-        for(int lx = 0;lx < dimH;lx++)
-            Hess -= y[lx]*LaplaceH[lx](x);
+        MatrixXd Hess = LaplaceL(x, y);
 
         // Find ~H = H + lambda * I
         Hess = MakePositiveSemidefinite(Hess, dimX);
@@ -95,7 +119,8 @@ VectorXd doIPM(
 
         x += dx, y += dy, w += dw;
 
-        if(dx.norm() <= 0.001)
+        // Stop the diverged run as well
+        if(dx.norm() <= 0.001 or not x.allFinite())
             break;
     }
 
@@ -105,83 +130,105 @@ VectorXd doIPM(
 // Solve : min  obj_f
 //         sub  con_hs >= 0 
 
-VectorXd Derivative_IPM(Derivative obj_f, vector<Derivative> con_hs, VectorXd start_guess){
-    int x_size = start_guess.size(), h_size = con_hs.size();
+IPMProblem BuildIPMProblem(Derivative obj_f, vector<Derivative> con_hs, int x_size){
+    int h_size = con_hs.size();
 
     vector<Derivative> v1w(x_size);
-    vector< vector<Derivative> > v2w(x_size, v1w);
 
     vector<Derivative> f_gradient = v1w;
-    vector< vector<Derivative> > f_hess = v2w;
-
     vector< vector<Derivative> > hs_gradient(h_size, v1w);
-    vector< vector< vector<Derivative> > > hs_hess(h_size, v2w);
 
     // Prebuild differiential function
     
     for(int lx = 0;lx < x_size;lx++)
         f_gradient[lx] = obj_f.diffPartial(lx);
 
-    for(int lx = 0;lx < x_size;lx++)
-        for(int ly = 0;ly < x_size;ly++)
-            f_hess[lx][ly] = f_gradient[lx].diffPartial(ly);
-    
-    for(int lh = 0;lh < h_size;lh++){
+    for(int lh = 0;lh < h_size;lh++)
         for(int lx = 0;lx < x_size;lx++)
             hs_gradient[lh][lx] = con_hs[lh].diffPartial(lx);
 
-        for(int lx = 0;lx < x_size;lx++)
-            for(int ly = 0;ly < x_size;ly++)
-                hs_hess[lh][lx][ly] = hs_gradient[lh][lx].diffPartial(ly);
-    }
+    // Hessian of Lagrangian is evaluated on one tape, no second order
+    // partial differential is built.
+    Eigen::DerivativeLagrangian lagrangian(obj_f, con_hs);
 
-    FuncDV F = [obj_f](VectorXd x){
+    FuncDV F = [obj_f](const VectorXd& x){
         return obj_f(x);
     };
 
-    FuncVV DelF = [f_gradient, x_size](VectorXd x){
+    FuncVV DelF = [f_gradient, x_size](const VectorXd& x){
         VectorXd ret(x_size);
         for(int lx = 0;lx < x_size;lx++)
             ret[lx] = f_gradient[lx](x);
         return ret;
     };
 
-    FuncMV LaplaceF = [f_hess, x_size](VectorXd x){ 
-        MatrixXd ret(x_size, x_size);
-        for(int lx = 0;lx < x_size;lx++)
-            for(int ly = 0;ly < x_size;ly++)
-                ret(lx, ly) = f_hess[lx][ly](x);
-        return ret; 
-    };
-
-    FuncVV H = [con_hs, h_size](VectorXd x){
+    FuncVV H = [con_hs, h_size](const VectorXd& x){
         VectorXd ret(h_size);
         for(int lx = 0;lx < h_size;lx++)
             ret[lx] = con_hs[lx](x);
         return ret;
     };
 
-    FuncMV DelH = [hs_gradient, h_size, x_size](VectorXd x){
+    FuncMV DelH = [hs_gradient, h_size, x_size](const VectorXd& x){
         MatrixXd A(h_size, x_size);
         for(int lh = 0;lh < h_size;lh++)
             for(int lx = 0;lx < x_size;lx++)
                 A(lh, lx) = hs_gradient[lh][lx](x);
         return A;
     };
-    
-    vector<FuncMV> LaplaceH(h_size);
-    
-    for(int lh = 0;lh < h_size;lh++){
-        LaplaceH[lh] = [hs_hess, lh, x_size](VectorXd x){
-            MatrixXd ret(x_size, x_size);
-            for(int lx = 0;lx < x_size;lx++)
-                for(int ly = 0;ly < x_size;ly++)
-                    ret(lx, ly) = hs_hess[lh][lx][ly](x);
-            return ret;
-        };
+
+    FuncMVV LaplaceL = [lagrangian](const VectorXd& x, const VectorXd& y){
+        return lagrangian.hessian(x, y);
     };
  
-    return doIPM(F, DelF, LaplaceF, H, DelH, LaplaceH, start_guess.size(), con_hs.size(), start_guess); 
+    return IPMProblem{F, DelF, H, DelH, LaplaceL, x_size, h_size};
+}
+
+VectorXd Derivative_IPM(Derivative obj_f, vector<Derivative> con_hs, VectorXd start_guess){
+    return doIPM(BuildIPMProblem(obj_f, con_hs, start_guess.size()), start_guess); 
+}
+
+// Run doIPM from every start on a pool of threads, the problem is built only
+// once. Once a feasible result with objective <= good_enough is found, the
+// other runs are cancelled and the starts not taken yet are skipped. Return
+// the best feasible result.
+VectorXd MultiStartIPM(
+    const IPMProblem& problem, const vector<VectorXd>& starts,
+    int threads, double good_enough
+){
+    std::atomic<int> next(0);
+    std::atomic<bool> cancel(false);
+
+    std::mutex best_mutex;
+    double best_f = std::numeric_limits<double>::infinity();
+    VectorXd best_x;
+
+    auto worker = [&](){
+        for(;;){
+            int ls = next++;
+            if(ls >= (int)starts.size() or cancel.load())
+                return;
+
+            VectorXd x = doIPM(problem, starts[ls], &cancel);
+            if(not x.allFinite() or problem.H(x).minCoeff() < -0.001)
+                continue;
+
+            double f = problem.F(x);
+            std::lock_guard<std::mutex> lock(best_mutex);
+            if(f < best_f)
+                best_f = f, best_x = x;
+            if(f <= good_enough)
+                cancel = true;
+        }
+    };
+
+    vector<std::thread> pool;
+    for(int lt = 0;lt < threads;lt++)
+        pool.push_back(std::thread(worker));
+    for(auto& t : pool)
+        t.join();
+
+    return best_x;
 }
 
 int main(){
@@ -228,5 +275,22 @@ int main(){
     x << 0.5, 0.5;
     std::cout << "x initial as " << x.transpose() << std::endl;
     std::cout << Derivative_IPM(obj_f, {con_h1, con_h2, con_h3}, x).transpose() << std::endl;
+
+    // Many starts on all cores, sharing one built problem
+    vector<VectorXd> starts(1000);
+    for(auto& start : starts)
+        start = VectorXd::Random(2)*2 + VectorXd::Ones(2);
+
+    IPMProblem problem = BuildIPMProblem(obj_f, {con_h1, con_h2, con_h3}, 2);
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+
+    std::cout << "multi start on " << threads << " threads" << std::endl;
+    std::cout << MultiStartIPM(problem, starts, threads, 1.001).transpose() << std::endl;
+
+    // Sparse KKT solver of the library, for large problems
+    Eigen::DerivativeIPM ipm(obj_f, {con_h1, con_h2, con_h3}, 2);
+    x << 4, -1;
+    std::cout << "sparse solver from " << x.transpose() << std::endl;
+    std::cout << ipm.solve(x).transpose() << std::endl;
     return 0;
 }
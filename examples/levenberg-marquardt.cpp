@@ -17,11 +17,12 @@ using std::vector;
 VectorXd LevenbergMarquardt(vector<Derivative> fs, VectorXd x){
     int x_size = x.size(), f_size = fs.size();
 
-    vector< vector<Derivative> > Jac( f_size, vector<Derivative>(x_size) );
-    
-    for(int lf = 0;lf < f_size;lf++)
-        for(int lx = 0;lx < x_size;lx++)
-            Jac[lf][lx] = fs[lf].diffPartial(lx);
+    // Residuals and Jacobian are evaluated on one tape, into the buffers
+    // allocated once.
+    Eigen::DerivativeTape tape(fs);
+    Eigen::DerivativeWorkspace ws;
+    MatrixXd J(f_size, x_size);
+    VectorXd rx(f_size);
     
     // Set eps to be very larg
     double mu = 0.01, eps = 10000000;
@@ -29,14 +30,8 @@ VectorXd LevenbergMarquardt(vector<Derivative> fs, VectorXd x){
     MatrixXd I = MatrixXd::Identity(x_size, x_size);
 
     for(int iter = 0;iter < 200;iter++){
-        MatrixXd J(f_size, x_size);
-        for(int lf = 0;lf < f_size;lf++)
-            for(int lx = 0;lx < x_size;lx++)
-                J(lf, lx) = Jac[lf][lx](x);
-
-        VectorXd rx(f_size);
-        for(int lf = 0;lf < f_size;lf++)
-            rx[lf] = fs[lf](x);
+        tape.jacobian(x, J, ws);
+        tape.evaluate(x, rx, ws);
 
         double rx_norm = rx.norm();
 
@@ -0,0 +1,97 @@
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <Eigen/Dense>
+
+#include "Derivative.h"
+
+using Eigen::VectorXd;
+
+using Eigen::Derivative;
+
+// Minimize f by Newton steps, each one solved by conjugate gradient with
+// Hessian-vector products only, so the Hessian is never formed and memory
+// stays linear in the size of the tape.
+VectorXd TruncatedNewton(Derivative f, VectorXd x, int& iterations){
+    int x_size = x.size();
+
+    Eigen::DerivativeTape tape({f});
+    Eigen::DerivativeWorkspace ws;
+    VectorXd w = VectorXd::Ones(1), fx(1), g(x_size), p(x_size), r(x_size), d(x_size), Hd(x_size), x_new(x_size);
+
+    for(iterations = 0;iterations < 500;iterations++){
+        tape.gradient(x, w, g, ws);
+        double g_norm = g.norm();
+        if(g_norm < 1e-8)
+            break;
+
+        // Inexact Newton step: stop conjugate gradient at relative residual
+        // eta, or at a direction of negative curvature.
+        double eta = std::min(0.5, std::sqrt(g_norm));
+        p.setZero();
+        r = -g;
+        d = r;
+        for(int lk = 0;lk < x_size;lk++){
+            tape.hessianVectorProduct(x, w, d, Hd, ws);
+            double curvature = d.dot(Hd);
+            if(curvature <= 0){
+                if(lk == 0)
+                    p = -g;
+                break;
+            }
+
+            double rr = r.squaredNorm(), alpha = rr/curvature;
+            p += alpha*d;
+            r -= alpha*Hd;
+            if(r.norm() < eta*g_norm)
+                break;
+            d = r + r.squaredNorm()/rr*d;
+        }
+
+        // Backtracking line search on the Armijo condition, falling back
+        // to steepest descent once if the Newton direction fails.
+        tape.evaluate(x, fx, ws);
+        double f0 = fx[0];
+        bool accepted = false;
+        for(int lt = 0;lt < 2 and not accepted;lt++){
+            if(lt == 1)
+                p = -g;
+            double step = 1;
+            for(int lk = 0;lk < 50;lk++){
+                x_new = x + step*p;
+                tape.evaluate(x_new, fx, ws);
+                if(fx[0] <= f0 + 1e-4*step*g.dot(p)){
+                    accepted = true;
+                    break;
+                }
+                step /= 2;
+            }
+        }
+        if(not accepted)
+            break;
+        x = x_new;
+    }
+
+    return x;
+}
+
+int main(){
+    // Minimize the extended Rosenbrock function of 10^4 variables
+    //   Sum_i 100*(x[2i+1] - x[2i]**2)**2 + (1 - x[2i])**2
+    // minimum 0 at x = 1.
+
+    int n = 10000;
+    Derivative x0 = Derivative::Variable(0), x1 = Derivative::Variable(1);
+    Derivative f = sum(100*pow(x1 - x0*x0, 2) + pow(1 - x0, 2), 0, n/2, 2);
+
+    VectorXd x(n);
+    for(int lx = 0;lx < n;lx += 2)
+        x[lx] = -1.2, x[lx + 1] = 1;
+
+    int iterations;
+    x = TruncatedNewton(f, x, iterations);
+    std::cout << iterations << " iterations, f = " << f(x)
+              << ", |x - 1| = " << (x - VectorXd::Ones(n)).norm() << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include <iostream>
+#include <chrono>
+#include <cmath>
+#include <vector>
+#include "Derivative.h"
+
+using Eigen::MatrixXd;
+using Eigen::VectorXd;
+using Eigen::Derivative;
+using Eigen::DerivativeTape;
+
+struct Timer{
+    std::chrono::steady_clock::time_point t1;
+    Timer(){
+        t1 = std::chrono::steady_clock::now();
+    }
+
+    double operator()(){
+        std::chrono::steady_clock::time_point t2 = std::chrono::steady_clock::now();
+        return std::chrono::duration_cast<std::chrono::duration<double> >(t2 - t1).count();
+    }
+};
+
+// Distance in ulp to the value of long double function
+double MaxUlp(const VectorXd& in, const VectorXd& out, long double (*ref)(long double)){
+    double ret = 0;
+    for(int li = 0;li < in.size();li++){
+        double r = (double)ref(in[li]);
+        double ulp = std::nextafter(std::abs(r), INFINITY) - std::abs(r);
+        ret = std::max(ret, (double)(std::abs(out[li] - ref(in[li]))/ulp));
+    }
+    return ret;
+}
+
+long double Pow25(long double x){
+    return std::pow(x, 2.5L);
+}
+
+int main(){
+    const int N = 1000000;
+
+    VectorXd in = VectorXd::Random(N)*700, out(N);
+    Eigen::batchExp(in.data(), out.data(), N);
+    std::cout << "exp max ulp " << MaxUlp(in, out, std::exp) << std::endl;
+
+    in = (VectorXd::Random(N)*700).array().exp();
+    Eigen::batchLog(in.data(), out.data(), N);
+    std::cout << "log max ulp " << MaxUlp(in, out, std::log) << std::endl;
+
+    in = VectorXd::Random(N).array() + 1.5;
+    Eigen::batchPow(in.data(), 2.5, out.data(), N);
+    std::cout << "pow max ulp " << MaxUlp(in, out, Pow25) << std::endl;
+
+    // Special values against std::exp, std::log and std::pow
+    const double inf = INFINITY, nan = NAN;
+    VectorXd special(12), value(12);
+    special << 0.0, -0.0, 1.0, -1.0, 0.5, -0.5, 2.0, -2.0, inf, -inf, nan, 1e-310;
+    std::vector<double> powers = {0.0, 1.0, -1.0, 2.5, 3.0, -3.0, 2.0, inf, -inf, nan};
+
+    int mismatches = 0;
+    // Exact on zero, infinity and NaN, within rounding elsewhere
+    auto check = [&](double a, double b){
+        bool same = b != b ? a != a : std::signbit(a) == std::signbit(b);
+        if(b == 0 or std::isinf(b))
+            same = same and a == b;
+        else if(b == b)
+            same = same and std::abs(a - b) <= 1e-15*std::abs(b);
+        if(not same)
+            mismatches++;
+    };
+    Eigen::batchExp(special.data(), value.data(), special.size());
+    for(int li = 0;li < special.size();li++)
+        check(value[li], std::exp(special[li]));
+    Eigen::batchLog(special.data(), value.data(), special.size());
+    for(int li = 0;li < special.size();li++)
+        check(value[li], std::log(special[li]));
+    for(double p : powers){
+        Eigen::batchPow(special.data(), p, value.data(), special.size());
+        for(int li = 0;li < special.size();li++)
+            check(value[li], std::pow(special[li], p));
+    }
+    std::cout << "special value mismatches " << mismatches << std::endl;
+
+    // Same tape on many points
+    Derivative x = Derivative::Variable(0),
+               y = Derivative::Variable(1);
+    Derivative f = exp(x*y) + log(x*x + 1) - pow(y*y + 1, 1.5);
+    DerivativeTape tape({f});
+
+    MatrixXd X = MatrixXd::Random(2, N);
+
+    Timer t1;
+    MatrixXd batch = tape.evaluateBatch(X);
+    std::cout << "Batch evaluation cost " << t1() << "s" << std::endl;
+
+    Timer t2;
+    VectorXd single(N);
+    for(int lp = 0;lp < N;lp++)
+        single[lp] = tape(VectorXd(X.col(lp)))[0];
+    std::cout << "Point by point evaluation cost " << t2() << "s" << std::endl;
+
+    std::cout << "Max difference " << (batch.row(0).transpose() - single).cwiseAbs().maxCoeff() << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,46 @@
+#include <iostream>
+#include <vector>
+#include "Derivative.h"
+
+using Eigen::VectorXd;
+using Eigen::Derivative;
+using Eigen::DerivativeTape;
+
+int main(){
+    Derivative x = Derivative::Variable(0),
+               a = Derivative::Variable(1),
+               b = Derivative::Variable(2),
+               y = Derivative::Variable(3);
+
+    VectorXd coef(4);
+    coef << 1, 2, 0, 3;
+    Derivative lin = Derivative(Eigen::ptrDerivativeNode(new Eigen::LinearDerivativeNode(coef)));
+
+    // x, y are unknown, a and b are data
+    Derivative f = exp(a*b)*x + sin(a)*pow(y, 2) + lin;
+    std::cout << f << std::endl;
+
+    Derivative g = f.bind({{1, 0.5}, {2, 2.0}});
+    std::cout << g << std::endl;
+
+    VectorXd v(4);
+    v << 0.3, 0.5, 2.0, 1.7;
+    std::cout << f(v) << " " << g(v) << std::endl;
+    std::cout << f.diffPartial(3)(v) << " " << g.diffPartial(3)(v) << std::endl;
+
+    // Dense numbering, y becomes x[1]
+    Derivative h = f.bind({{1, 0.5}, {2, 2.0}}, true);
+    std::cout << h << std::endl;
+
+    VectorXd u(2);
+    u << 0.3, 1.7;
+    std::cout << h(u) << " " << h.diffPartial(1)(u) << std::endl;
+
+    // Shared subtree stays shared
+    std::vector<Derivative> fs = Eigen::bind({f, f.diffPartial(0)}, {{1, 0.5}, {2, 2.0}}, true);
+    DerivativeTape full({f, f.diffPartial(0)}), small(fs);
+    std::cout << full.size() << " " << small.size() << " "
+              << small(u).transpose() << std::endl;
+
+    return 0;
+}
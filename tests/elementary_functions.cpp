@@ -0,0 +1,73 @@
+#include <iostream>
+#include <cmath>
+#include <vector>
+#include "Derivative.h"
+
+using Eigen::Array4d;
+using Eigen::VectorXd;
+using Eigen::MatrixXd;
+using Eigen::Derivative;
+using Eigen::DerivativeTape;
+using Eigen::DerivativeWorkspace;
+
+int main(){
+    Derivative x = Derivative::Variable(0),
+               y = Derivative::Variable(1);
+
+    std::pair<Derivative, Derivative> sc = sincos(x*y);
+    Derivative f = sc.first*sc.second + tanh(x) + sqrt(y) + sigmoid(x - y)
+                 + softplus(x*y) + abs(x - y) + pow(x, 3) + pow(y, 2.5);
+
+    VectorXd v(2);
+    v << 0.7, 1.3;
+    double X = v[0], Y = v[1];
+
+    double expect = std::sin(X*Y)*std::cos(X*Y) + std::tanh(X) + std::sqrt(Y)
+                  + 1/(1 + std::exp(Y - X)) + std::log1p(std::exp(X*Y))
+                  + std::abs(X - Y) + std::pow(X, 3) + std::pow(Y, 2.5);
+    std::cout << "value    " << f(v) << " expect " << expect << std::endl;
+
+    // Large argument of softplus doesn't overflow
+    std::cout << "softplus " << softplus(x)(VectorXd::Constant(1, 800)) << std::endl;
+
+    // Tape against symbolic
+    DerivativeTape tape({f});
+    DerivativeWorkspace ws;
+    VectorXd g = tape.gradient(v, VectorXd::Ones(1));
+    MatrixXd H = tape.hessian(v, VectorXd::Ones(1));
+
+    std::cout << "gradient " << g.transpose() << std::endl;
+    std::cout << "expect   " << f.diffPartial(0)(v) << " " << f.diffPartial(1)(v) << std::endl;
+    std::cout << "hessian  " << H.row(0) << " " << H.row(1) << std::endl;
+    std::cout << "expect   " << f.diffPartial(0).diffPartial(0)(v) << " "
+              << f.diffPartial(0).diffPartial(1)(v) << " "
+              << f.diffPartial(1).diffPartial(0)(v) << " "
+              << f.diffPartial(1).diffPartial(1)(v) << std::endl;
+
+    // Batch and lanes
+    MatrixXd P(2, 3), out(1, 3);
+    P << 0.7, -0.4, 2.0,
+         1.3, 0.9, 0.2;
+    tape.evaluateBatch(P, out, ws);
+
+    std::vector<Array4d> lanes(2), lout(1);
+    lanes[0] << 0.7, -0.4, 2.0, 0;
+    lanes[1] << 1.3, 0.9, 0.2, 1;
+    tape.evaluate(lanes.data(), lout.data());
+
+    for(int ll = 0;ll < 3;ll++)
+        std::cout << "point " << ll << " " << out(0, ll) << " " << lout[0][ll]
+                  << " expect " << f(P.col(ll)) << std::endl;
+
+    // Cos before Sin of the same operand on the tape
+    Derivative u = x - y*y, h = cos(u)*(x + sin(u));
+    DerivativeTape htape({h});
+    VectorXd hg = htape.gradient(v, VectorXd::Ones(1));
+    htape.evaluateBatch(P, out, ws);
+    std::cout << "cos first " << hg.transpose() << " expect " << h.diffPartial(0)(v) << " "
+              << h.diffPartial(1)(v) << std::endl;
+    std::cout << "cos first " << out << " expect " << h(P.col(0)) << " " << h(P.col(1)) << " "
+              << h(P.col(2)) << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,52 @@
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include "Derivative.h"
+
+using Eigen::VectorXd;
+using Eigen::Derivative;
+using Eigen::DerivativeTape;
+
+int main(){
+    // Objective of many variables whose terms share a common subexpression
+    int n = 100;
+    std::vector<Derivative> xs(n);
+    for(int lx = 0;lx < n;lx++)
+        xs[lx] = Derivative::Variable(lx);
+
+    auto build = [&](){
+        Derivative s = 0;
+        for(int lx = 0;lx < n;lx++)
+            s = s + xs[lx]*xs[lx];
+        Derivative f = log(s + 1);
+        for(int lx = 0;lx + 1 < n;lx++)
+            f = f + sin(xs[lx])*exp(xs[lx + 1]/s);
+        return f;
+    };
+
+    VectorXd v = VectorXd::LinSpaced(n, -1, 1);
+
+    // One by one on another graph of the same function
+    Derivative f = build(), g = build();
+    std::vector<Derivative> partial;
+    for(int lx = 0;lx < n;lx++)
+        partial.push_back(g.diffPartial(lx));
+
+    std::vector<Derivative> grad = f.gradientGraph(n);
+
+    double error = 0;
+    for(int lx = 0;lx < n;lx++)
+        error = std::max(error, std::abs(grad[lx](v) - partial[lx](v)));
+    std::cout << "error " << error << std::endl;
+
+    std::cout << "nodes of f " << DerivativeTape({f}).size()
+              << ", reverse sweep " << DerivativeTape(grad).size()
+              << ", one by one " << DerivativeTape(partial).size() << std::endl;
+
+    // diffPartial returns the saved node, and second order still works
+    std::cout << "shared " << (f.diffPartial(3).inst == grad[3].inst) << std::endl;
+    std::cout << "second " << grad[0].diffPartial(1)(v) << " "
+              << partial[0].diffPartial(1)(v) << std::endl;
+
+    return 0;
+}
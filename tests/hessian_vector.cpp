@@ -0,0 +1,37 @@
+#include <iostream>
+#include "Derivative.h"
+
+using Eigen::VectorXd;
+using Eigen::MatrixXd;
+using Eigen::Derivative;
+using Eigen::DerivativeTape;
+
+int main(){
+    Derivative x = Derivative::Variable(0), y = Derivative::Variable(1), z = Derivative::Variable(2);
+    Eigen::Vector3d lin(1, -2, 0.5);
+    Derivative l(Eigen::ptrDerivativeNode(new Eigen::LinearDerivativeNode(lin)));
+
+    Derivative f = exp(x*y) + sin(y*z)*log(1 + x*x) + pow(z, 3)/y + l*l;
+    Derivative g = x*y*z + tanh(l);
+
+    VectorXd v(3), d(3);
+    v << 0.3, 1.2, -0.7;
+    d << 1, -0.5, 2;
+
+    // Against the full Hessian
+    std::cout << f.hessianVectorProduct(v, d).transpose() << std::endl;
+    std::cout << (DerivativeTape({f}).hessian(v, VectorXd::Ones(1))*d).transpose() << std::endl;
+
+    // Weighted sum of the outputs, into the caller's buffer
+    DerivativeTape tape({f, g});
+    VectorXd w(2);
+    w << 1, -3;
+    std::cout << (tape.hessian(v, w)*d).transpose() << std::endl;
+
+    Eigen::DerivativeWorkspace ws;
+    VectorXd Hd(3);
+    tape.hessianVectorProduct(v, w, d, Hd, ws);
+    std::cout << Hd.transpose() << std::endl;
+
+    return 0;
+}
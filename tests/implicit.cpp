@@ -0,0 +1,79 @@
+#include <iostream>
+#include <cmath>
+#include "Derivative.h"
+
+using Eigen::VectorXd;
+using Eigen::Derivative;
+
+int main(){
+    Derivative x0 = Derivative::Variable(0), x1 = Derivative::Variable(1),
+               x2 = Derivative::Variable(2), x3 = Derivative::Variable(3);
+
+    // y(p) with y**3 + p*y - 1 = 0, p = x[0] and y = x[1]
+    Derivative y = implicitRoot({pow(x1, 3) + x0*x1 - 1}, {1}, VectorXd::Ones(1))[0];
+    Derivative dy = y.diffPartial(0), ddy = dy.diffPartial(0);
+
+    VectorXd p(1);
+    p << 2;
+    double yp = y(p), h = 1e-4;
+    auto slope = [](double y, double p){ return -y/(3*y*y + p); };
+    std::cout << y << " = " << yp << ", residual " << yp*yp*yp + 2*yp - 1 << std::endl;
+    std::cout << "dy/dp " << dy(p) << " " << slope(yp, 2) << std::endl;
+
+    VectorXd pl(1), pr(1);
+    pl << 2 - h;
+    pr << 2 + h;
+    std::cout << "d2y/dp2 " << ddy(p) << " "
+              << (slope(y(pr), 2 + h) - slope(y(pl), 2 - h))/(2*h) << std::endl;
+    std::cout << "dy/dx[3] " << y.diffPartial(3) << std::endl;
+
+    // Line a + b*t fitted to data p0 + p1*t**2, a = x[2] and b = x[3],
+    // inside an outer objective of p = (x[0], x[1])
+    Derivative fit = 0;
+    for(int lt = 0;lt < 5;lt++)
+        fit = fit + pow(x2 + x3*lt - x0 - x1*lt*lt, 2);
+    std::vector<Derivative> ab = implicitArgmin(fit, {2, 3}, VectorXd::Zero(2));
+    Derivative outer = pow(ab[0] - 1, 2) + pow(ab[1] - 2, 2);
+
+    VectorXd q(2);
+    q << 0.5, 0.3;
+    std::cout << "a " << ab[0](q) << ", b " << ab[1](q) << std::endl;
+    for(int lx = 0;lx < 2;lx++){
+        VectorXd ql = q, qr = q;
+        ql[lx] -= h, qr[lx] += h;
+        std::cout << "d/dp" << lx << " " << outer.diffPartial(lx)(q) << " "
+                  << (outer(qr) - outer(ql))/(2*h) << std::endl;
+    }
+
+    // Variables of the root are those of the residuals but the unknowns
+    std::cout << "variables";
+    for(int v : (outer + y).variables())
+        std::cout << " " << v;
+    std::cout << std::endl;
+
+    // A root inside the residual of another root: w**3 + w = y(p)
+    Derivative w = implicitRoot({pow(x2, 3) + x2 - y}, {2}, VectorXd::Zero(1))[0];
+    double wp = w(p), dw = dy(p)/(3*wp*wp + 1);
+    std::cout << "w " << wp << ", dw/dp " << w.diffPartial(0)(p) << " " << dw << std::endl;
+
+    // No root, y**2 + p**2 + 1 > 0
+    Derivative none = implicitRoot({x1*x1 + x0*x0 + 1}, {1}, VectorXd::Ones(1))[0];
+    std::cout << "no root " << none(p) << " " << none.diffPartial(0)(p) << std::endl;
+
+    // Graph passes take the root by its call and diffPartial: sqrt(x[0])*x[0]
+    Derivative g = implicitRoot({x1*x1 - x0}, {1}, VectorXd::Ones(1))[0]*x0;
+    VectorXd r(3);
+    r << 4, 0, 3;
+    std::vector<Derivative> grad = g.gradientGraph(3);
+    std::cout << "gradientGraph " << grad[0](r) << " " << 1.5*std::sqrt(r[0]) << ", " << grad[2](r) << std::endl;
+    std::cout << "polynomial " << g.polynomial()(r) << std::endl;
+    std::cout << "bind unused " << g.bind({{2, 2.0}})(r) << std::endl;
+
+    // x[0] = 9 bound and x[2] renumbered to x[1]
+    Derivative gb = (g*x2).bind({{0, 9.0}}, true);
+    VectorXd rb(2);
+    rb << 0, 3;
+    std::cout << gb << " = " << gb(rb) << ", d/dx[1] " << gb.diffPartial(1)(rb) << std::endl;
+
+    return 0;
+}
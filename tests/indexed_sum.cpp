@@ -0,0 +1,95 @@
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <cstddef>
+#include <atomic>
+#include <thread>
+#include "Derivative.h"
+
+// Count heap allocations by interposing glibc's malloc
+static std::atomic<long> allocations(0);
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* malloc(size_t size){
+    allocations++;
+    return __libc_malloc(size);
+}
+
+using Eigen::VectorXd;
+using Eigen::Derivative;
+using Eigen::DerivativeTape;
+
+int main(){
+    Derivative x0 = Derivative::Variable(0), x1 = Derivative::Variable(1);
+
+    // Chained Rosenbrock, one term template for all i
+    Derivative term = 100*pow(x1 - x0*x0, 2) + pow(1 - x0, 2);
+    int n = 1000;
+    Derivative f = sum(term, 0, n - 1);
+    std::cout << f << std::endl;
+
+    // The same by a node for each term
+    std::vector<Derivative> xs(n);
+    for(int lx = 0;lx < n;lx++)
+        xs[lx] = Derivative::Variable(lx);
+    Derivative g = 0;
+    for(int lx = 0;lx + 1 < n;lx++)
+        g = g + 100*pow(xs[lx + 1] - xs[lx]*xs[lx], 2) + pow(1 - xs[lx], 2);
+
+    VectorXd v = VectorXd::LinSpaced(n, -1.2, 1.1);
+    std::cout << "value " << f(v) << " " << g(v) << std::endl;
+
+    // Evaluation reuses its buffers after the first call
+    f(v);
+    long before = allocations;
+    double fv = f(v);
+    std::cout << "allocations " << allocations - before << " " << fv << std::endl;
+
+    // Threads evaluate the same graph, each with its own buffers
+    std::vector<double> values(4);
+    std::vector<std::thread> threads;
+    for(int lt = 0;lt < 4;lt++)
+        threads.push_back(std::thread([&, lt](){
+            for(int lk = 0;lk < 200;lk++)
+                values[lt] = f(v);
+        }));
+    for(std::thread& t : threads)
+        t.join();
+    std::cout << "threads " << (values == std::vector<double>(4, fv)) << std::endl;
+
+    // Only the terms containing x[k]
+    for(int k : {0, 500, n - 1}){
+        Derivative fk = f.diffPartial(k);
+        std::cout << "d/dx[" << k << "] " << fk(v) << " " << g.diffPartial(k)(v) << std::endl;
+    }
+    std::cout << f.diffPartial(500) << std::endl;
+    std::cout << "second " << f.diffPartial(500).diffPartial(501)(v) << " "
+              << g.diffPartial(500).diffPartial(501)(v) << std::endl;
+
+    // Tape loops the term as one entry
+    DerivativeTape tape({f}), tape_g({g});
+    VectorXd one = VectorXd::Ones(1);
+    VectorXd grad = tape.gradient(v, one);
+    std::cout << "tape " << tape.size() << " entries, " << tape_g.size() << " expanded" << std::endl;
+    std::cout << "tape " << tape(v)[0] << " " << grad[500] << " " << tape_g.gradient(v, one)[500] << std::endl;
+    std::cout << "hessian " << (tape.hessian(v, one) - tape_g.hessian(v, one)).norm() << std::endl;
+
+    Eigen::DerivativeSparseHessian sh(tape, n), sh_g(tape_g, n);
+    Eigen::DerivativeWorkspace ws;
+    std::cout << "sparse hessian " << sh.compute(v, one, ws).nonZeros() << " "
+              << (Eigen::MatrixXd(sh.compute(v, one, ws)) - Eigen::MatrixXd(sh_g.compute(v, one, ws))).norm() << std::endl;
+
+    // Binding keeps the terms without a bound variable as sums
+    Derivative fb = f.bind({{500, 0.5}}, true), gb = g.bind({{500, 0.5}}, true);
+    VectorXd vb(n - 1);
+    vb << v.head(500), v.tail(n - 501);
+    std::cout << fb << std::endl;
+    std::cout << "bind " << fb(vb) << " " << gb(vb) << std::endl;
+
+    // Grid terms with stride, x[2i] * x[2i+1]
+    Derivative pairs = sum(x0*x1, 0, 3, 2);
+    VectorXd u(6);
+    u << 1, 2, 3, 4, 5, 6;
+    std::cout << pairs << " = " << pairs(u) << ", d/dx[3] " << pairs.diffPartial(3)(u) << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,54 @@
+#include <iostream>
+#include <vector>
+#include "Derivative.h"
+
+using Eigen::MatrixXd;
+using Eigen::VectorXd;
+using Eigen::Derivative;
+using Eigen::DerivativeLagrangian;
+
+// Hessian by symbolic partial differential
+MatrixXd SymbolicHessian(Derivative f, const VectorXd& x){
+    int n = x.size();
+    MatrixXd ret(n, n);
+    for(int lx = 0;lx < n;lx++)
+        for(int ly = 0;ly < n;ly++)
+            ret(lx, ly) = f.diffPartial(lx).diffPartial(ly)(x);
+    return ret;
+}
+
+int main(){
+    Derivative x = Derivative::Variable(0),
+               y = Derivative::Variable(1),
+               z = Derivative::Variable(2);
+
+    Derivative f = x*y*z + exp(x*y) + log(z*z + 1) + pow(y, 3.5);
+    std::vector<Derivative> hs = {
+        x*x + y*y + z*z - 1,
+        x/(y + 2) - z,
+        exp(x)*log(y + z)
+    };
+
+    VectorXd v(3), w(3);
+    v << 0.3, 1.2, 0.8;
+    w << 0.5, -1, 2;
+
+    DerivativeLagrangian lag(f, hs);
+
+    MatrixXd expect = SymbolicHessian(f, v);
+    for(int lh = 0;lh < (int)hs.size();lh++)
+        expect -= w[lh]*SymbolicHessian(hs[lh], v);
+
+    std::cout << lag.hessian(v, w) << std::endl;
+    std::cout << "Difference to symbolic hessian " << (lag.hessian(v, w) - expect).norm() << std::endl;
+
+    VectorXd grad(3);
+    for(int lx = 0;lx < 3;lx++){
+        grad[lx] = f.diffPartial(lx)(v);
+        for(int lh = 0;lh < (int)hs.size();lh++)
+            grad[lx] -= w[lh]*hs[lh].diffPartial(lx)(v);
+    }
+    std::cout << "Difference to symbolic gradient " << (lag.gradient(v, w) - grad).norm() << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,31 @@
+#include <iostream>
+#include "Derivative.h"
+
+using Eigen::VectorXd;
+using Eigen::Derivative;
+
+int main(){
+    Derivative x = Derivative::Variable(0),
+               y = Derivative::Variable(1),
+               z = Derivative::Variable(2);
+
+    Derivative f = x*x*y + exp(y*z) + 3*x;
+
+    // Same node whatever the order of indices
+    std::cout << (f.diffPartial({0, 1}).inst == f.diffPartial({1, 0}).inst) << std::endl;
+    std::cout << (f.diffPartial({2, 1, 1}).inst == f.diffPartial({1, 2, 1}).inst) << std::endl;
+
+    VectorXd v(3);
+    v << 0.5, 1.5, -0.5;
+    std::cout << f.diffPartial({1, 0})(v) << " " << f.diffPartial(0).diffPartial(1)(v) << std::endl;
+
+    // Only the partial differential which are not zero
+    for(auto& kv : f.diffPartials(3)){
+        std::cout << "d";
+        for(int ind : kv.first)
+            std::cout << " x[" << ind << "]";
+        std::cout << " : " << kv.second << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,66 @@
+#include <iostream>
+#include <memory>
+#include <vector>
+#include "Derivative.h"
+
+using Eigen::Derivative;
+
+// Whether the root of f is freed once f and its partial differential are
+// gone, after differentiating by each variable twice.
+bool freed(const std::function<Derivative(Derivative, Derivative)>& f){
+    std::weak_ptr<Eigen::DerivativeNode> root;
+    {
+        Derivative g = f(Derivative::Variable(0), Derivative::Variable(1));
+        root = g.inst;
+        for(int lx = 0;lx < 2;lx++)
+            for(int ly = 0;ly < 2;ly++)
+                g.diffPartial(lx).diffPartial(ly);
+    }
+    return root.expired();
+}
+
+int main(){
+    std::vector<std::pair<const char*, std::function<Derivative(Derivative, Derivative)> > > cases = {
+        {"exp(x*y)", [](Derivative x, Derivative y){ return exp(x*y); }},
+        {"exp(x)", [](Derivative x, Derivative y){ return exp(x); }},
+        {"tanh(x*y)", [](Derivative x, Derivative y){ return tanh(x*y); }},
+        {"sqrt(x*y)", [](Derivative x, Derivative y){ return sqrt(x*y); }},
+        {"sigmoid(x*y)", [](Derivative x, Derivative y){ return sigmoid(x*y); }},
+        {"softplus(x*y)", [](Derivative x, Derivative y){ return softplus(x*y); }},
+        {"sin(x*y)", [](Derivative x, Derivative y){ return sin(x*y); }},
+        {"cos(x*y)", [](Derivative x, Derivative y){ return cos(x*y); }},
+        {"x/y", [](Derivative x, Derivative y){ return x/y; }},
+    };
+
+    bool all_freed = true;
+    for(auto& c : cases){
+        bool ok = freed(c.second);
+        std::cout << c.first << " freed " << ok << std::endl;
+        all_freed = all_freed and ok;
+    }
+
+    // The symbolic reverse sweep saves the gradient in the root
+    std::weak_ptr<Eigen::DerivativeNode> g_root;
+    {
+        Derivative x = Derivative::Variable(0), y = Derivative::Variable(1);
+        Derivative f = x/y + exp(x*y)*tanh(y) + sqrt(x)*sigmoid(y) + cos(x*y);
+        g_root = f.inst;
+        f.gradientGraph(2);
+    }
+    std::cout << "gradientGraph freed " << g_root.expired() << std::endl;
+    all_freed = all_freed and g_root.expired();
+
+    // Both of sincos, differentiated
+    std::weak_ptr<Eigen::DerivativeNode> s_root, c_root;
+    {
+        Derivative x = Derivative::Variable(0), y = Derivative::Variable(1);
+        std::pair<Derivative, Derivative> sc = sincos(x*y);
+        s_root = sc.first.inst, c_root = sc.second.inst;
+        sc.first.diffPartial(0).diffPartial(1);
+        sc.second.diffPartial(0).diffPartial(1);
+    }
+    bool ok = s_root.expired() and c_root.expired();
+    std::cout << "sincos freed " << ok << std::endl;
+
+    return all_freed and ok ? 0 : 1;
+}
@@ -0,0 +1,59 @@
+#include <iostream>
+#include <cstddef>
+#include "Derivative.h"
+
+// Count heap allocations by interposing glibc's malloc
+static long allocations = 0;
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* malloc(size_t size){
+    allocations++;
+    return __libc_malloc(size);
+}
+
+using Eigen::VectorXd;
+using Eigen::Derivative;
+using Eigen::DerivativeTape;
+
+int main(){
+    Derivative x = Derivative::Variable(0), y = Derivative::Variable(1), z = Derivative::Variable(2);
+    VectorXd v(3);
+    v << 0.5, -1.5, 2;
+
+    // Constraint of the interior point example
+    Derivative h = x*x + y*y - 1;
+    Derivative hp = h.polynomial();
+    std::cout << h << " -> " << hp << std::endl;
+    std::cout << hp(v) << " " << h(v) << std::endl;
+
+    // Expanded, the partial differential lowers the degree
+    Derivative f = pow(x + 2*y - z, 3)*(x - y) + 4*x*y*z/2;
+    Derivative fp = f.polynomial();
+    std::cout << fp << std::endl;
+    std::cout << fp(v) << " " << f(v) << std::endl;
+    for(int lx = 0;lx < 3;lx++)
+        std::cout << "d/dx[" << lx << "] " << fp.diffPartial(lx)(v) << " " << f.diffPartial(lx)(v) << std::endl;
+    std::cout << fp.diffPartial({0, 0, 1}) << " = " << fp.diffPartial({0, 0, 1})(v)
+              << " " << f.diffPartial({0, 0, 1})(v) << std::endl;
+    std::cout << fp.diffPartial({0, 0, 0, 0, 0}) << std::endl;
+
+    // The power table is reused after the first call
+    long before = allocations;
+    double fv = fp(v);
+    std::cout << "allocations " << allocations - before << " " << fv << std::endl;
+
+    // Only the polynomial subgraphs are converted
+    Derivative g = exp(x*y - y*x + z*z) + log(1 + x*x)*sin(y);
+    std::cout << g.polynomial() << std::endl;
+    std::cout << g.polynomial()(v) << " " << g(v) << std::endl;
+
+    // The tape records the Horner form
+    DerivativeTape tape({fp});
+    VectorXd grad = tape.gradient(v, VectorXd::Ones(1));
+    std::cout << "tape " << tape(v)[0] << " " << grad.transpose() << std::endl;
+
+    // Too many terms to expand
+    Derivative big = pow(x + y + z + 1, 20);
+    std::cout << big.polynomial(100) << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,36 @@
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include "Derivative.h"
+
+using Eigen::Derivative;
+
+int main(){
+    Derivative x = Derivative::Variable(0), y = Derivative::Variable(1);
+    Derivative xy = x*y;
+    Derivative f = exp(xy) + sin(xy);
+
+    std::cout << f << std::endl;
+    f.printShared(std::cout);
+    std::cout << std::endl;
+
+    // Fully expanded, this would print 2^60 copies of x[0]
+    Derivative g = x + 1;
+    for(int lk = 0;lk < 60;lk++)
+        g = g*g;
+
+    std::ostringstream shared;
+    g.printShared(shared);
+    std::string text = shared.str();
+    std::cout << "lines " << std::count(text.begin(), text.end(), '\n')
+              << " size " << text.size() << std::endl;
+
+    std::cout << g.toString(60) << std::endl;
+    std::cout << f.toString(1000) << std::endl;
+
+    // Second derivative shares its subexpressions
+    f.diffPartial(0).diffPartial(1).printShared(std::cout);
+    std::cout << std::endl;
+
+    return 0;
+}
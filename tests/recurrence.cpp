@@ -0,0 +1,51 @@
+#include <iostream>
+#include <vector>
+#include "Derivative.h"
+
+using Eigen::VectorXd;
+using Eigen::Derivative;
+using Eigen::DerivativeRecurrence;
+
+int main(){
+    // Damped oscillator by explicit Euler, state (u, v), parameters (k, c)
+    Derivative u = Derivative::Variable(0), v = Derivative::Variable(1),
+               k = Derivative::Variable(2), c = Derivative::Variable(3);
+    double h = 0.001;
+
+    DerivativeRecurrence rec(
+        {u + h*v, v - h*(k*u + c*v)},
+        pow(u - 0.2, 2) + pow(v, 2),
+        2
+    );
+
+    VectorXd s0(2), x(2);
+    s0 << 1, 0;
+    x << 4, 0.3;
+
+    int steps = 10000;
+    VectorXd full(4), g(4);
+    double J = rec.gradient(s0, x, steps, steps, full);
+    std::cout << "J " << J << " gradient " << full.transpose()
+              << " steps " << rec.forwardSteps() << std::endl;
+
+    for(int checkpoints : {2, 5, 20, 100}){
+        rec.gradient(s0, x, steps, checkpoints, g);
+        std::cout << "checkpoints " << checkpoints << " error " << (g - full).norm()
+                  << " steps " << rec.forwardSteps() << std::endl;
+    }
+
+    // Without checkpoint the recomputation is quadratic, keep it short
+    rec.gradient(s0, x, 300, 300, full);
+    rec.gradient(s0, x, 300, 0, g);
+    std::cout << "checkpoints 0 error " << (g - full).norm()
+              << " steps " << rec.forwardSteps() << std::endl;
+
+    // Finite difference on k
+    VectorXd xp = x, xm = x;
+    xp[0] += 1e-6, xm[0] -= 1e-6;
+    rec.gradient(s0, x, steps, 20, g);
+    std::cout << "dJ/dk " << g[2] << " expect "
+              << (rec(s0, xp, steps) - rec(s0, xm, steps))/2e-6 << std::endl;
+
+    return 0;
+}
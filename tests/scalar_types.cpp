@@ -0,0 +1,46 @@
+#include <iostream>
+#include <vector>
+#include "Derivative.h"
+
+using Eigen::Array4d;
+using Eigen::VectorXd;
+using Eigen::VectorXf;
+using Eigen::Matrix;
+using Eigen::Derivative;
+using Eigen::DerivativeTape;
+
+typedef Matrix<long double, Eigen::Dynamic, 1> VectorXld;
+
+int main(){
+    Derivative x = Derivative::Variable(0),
+               y = Derivative::Variable(1);
+
+    Derivative f = exp(x*y) / (x*x + 1) + log(y) - pow(x + y, 1.5);
+    DerivativeTape tape({f, f.diffPartial(0)});
+
+    VectorXd v(2);
+    v << 0.7, 1.3;
+
+    std::cout << "double      " << tape(v).transpose() << std::endl;
+    std::cout << "float       " << tape(VectorXf(v.cast<float>())).transpose() << std::endl;
+
+    VectorXld lv = tape(VectorXld(v.cast<long double>()));
+    std::cout.precision(18);
+    std::cout << "long double " << lv.transpose() << std::endl;
+    std::cout.precision(6);
+
+    // Four points in one sweep, x[i] holds lanes of variable i
+    std::vector<Array4d> lanes(2), out(tape.numOutputs());
+    lanes[0] << 0.7, 0.1, 1.0, 2.0;
+    lanes[1] << 1.3, 0.5, 1.0, 0.2;
+    tape.evaluate(lanes.data(), out.data());
+
+    for(int ll = 0;ll < 4;ll++){
+        VectorXd p(2);
+        p << lanes[0][ll], lanes[1][ll];
+        std::cout << "lane " << ll << " " << out[0][ll] << " " << out[1][ll]
+                  << " expect " << f(p) << " " << f.diffPartial(0)(p) << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,70 @@
+#include <iostream>
+#include <vector>
+#include "Derivative.h"
+
+using Eigen::VectorXd;
+using Eigen::MatrixXd;
+using Eigen::Derivative;
+using Eigen::DerivativeTape;
+using Eigen::DerivativeWorkspace;
+using Eigen::DerivativeSparseHessian;
+using Eigen::DerivativeIPM;
+
+int main(){
+    Derivative x = Derivative::Variable(0), y = Derivative::Variable(1),
+               z = Derivative::Variable(2);
+
+    // Sparse Hessian against the dense one
+    Derivative f = exp(x*y) + pow(z, 3) + x/z;
+    DerivativeTape tape({f, sin(y) * y});
+    DerivativeSparseHessian sh(tape, 3);
+    DerivativeWorkspace ws;
+
+    VectorXd v(3), w(2);
+    v << 0.3, 0.7, 1.2;
+    w << 1, -2;
+    std::cout << "colors " << sh.numColors() << " error "
+              << (MatrixXd(sh.compute(v, w, ws)) - tape.hessian(v, w)).cwiseAbs().maxCoeff() << std::endl;
+
+    // Same problem as examples/interior-point-method.cpp
+    //   min  x+y  sub  xx + yy >= 1, x >= 0, y >= 0
+    DerivativeIPM ipm(x + y, {x*x + y*y - 1, x, y}, 2);
+    std::vector<VectorXd> starts(4, VectorXd(2));
+    starts[0] << 1, 1;
+    starts[1] << 2, 1;
+    starts[2] << 4, -1;
+    starts[3] << 0.2, 0.7;
+    for(const VectorXd& start : starts){
+        VectorXd sol = ipm.solve(start);
+        std::cout << "start " << start.transpose() << " -> " << sol.transpose()
+                  << " in " << ipm.iterations() << ", converged " << (ipm.info() == Eigen::Success) << std::endl;
+    }
+
+    // Too few steps
+    ipm.solve(starts[2], 2);
+    std::cout << "2 steps, converged " << (ipm.info() == Eigen::Success) << std::endl;
+
+    // Large sparse problem
+    //   min  sum (x_i - 1)^2 + (x_i - x_{i+1})^2  sub  x_i >= 0, 1 - x_i - x_{i+1} >= 0
+    int n = 5000;
+    std::vector<Derivative> xs(n), hs;
+    for(int lx = 0;lx < n;lx++)
+        xs[lx] = Derivative::Variable(lx);
+
+    Derivative obj = 0;
+    for(int lx = 0;lx < n;lx++){
+        obj = obj + pow(xs[lx] - 1, 2);
+        hs.push_back(xs[lx]);
+        if(lx + 1 < n){
+            obj = obj + pow(xs[lx] - xs[lx + 1], 2);
+            hs.push_back(1 - xs[lx] - xs[lx + 1]);
+        }
+    }
+
+    DerivativeIPM big(obj, hs, n);
+    VectorXd sol = big.solve(VectorXd::Constant(n, 0.1));
+    std::cout << "large " << sol.head(4).transpose() << " ... " << sol.tail(2).transpose()
+              << " in " << big.iterations() << ", converged " << (big.info() == Eigen::Success) << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,40 @@
+#include <iostream>
+#include <vector>
+#include "Derivative.h"
+
+using Eigen::VectorXd;
+using Eigen::MatrixXd;
+using Eigen::SparseMatrix;
+using Eigen::Derivative;
+using Eigen::DerivativeTape;
+using Eigen::DerivativeWorkspace;
+using Eigen::DerivativeSparseJacobian;
+
+int main(){
+    // Chained residuals, each one touches three neighbour variables
+    int n = 2000;
+    std::vector<Derivative> xs(n), fs;
+    for(int lx = 0;lx < n;lx++)
+        xs[lx] = Derivative::Variable(lx);
+
+    for(int lx = 0;lx < n;lx++){
+        Derivative f = pow(xs[lx], 2) - 2*xs[(lx + 1) % n];
+        if(lx > 0)
+            f = f + sin(xs[lx - 1]*xs[lx]);
+        fs.push_back(f);
+    }
+
+    DerivativeTape tape(fs);
+    DerivativeSparseJacobian sj(tape, n);
+    std::cout << "colors " << sj.numColors() << " nonzeros " << sj.matrix().nonZeros() << std::endl;
+
+    DerivativeWorkspace ws;
+    for(int li = 0;li < 3;li++){
+        VectorXd x = VectorXd::LinSpaced(n, -1, 1 + li);
+        const SparseMatrix<double>& J = sj.compute(x, ws);
+        MatrixXd dense = tape.jacobian(x);
+        std::cout << "error " << (MatrixXd(J) - dense).cwiseAbs().maxCoeff() << std::endl;
+    }
+
+    return 0;
+}
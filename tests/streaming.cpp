@@ -0,0 +1,84 @@
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <unistd.h>
+#include "Derivative.h"
+
+using Eigen::VectorXd;
+using Eigen::MatrixXd;
+using Eigen::Ref;
+using Eigen::Derivative;
+using Eigen::DerivativeTape;
+using Eigen::DerivativeWorkspace;
+
+int main(){
+    // One residual template b*exp(-a*t) - y, t and y are data
+    Derivative a = Derivative::Variable(0),
+               b = Derivative::Variable(1),
+               t = Derivative::Parameter(0),
+               y = Derivative::Parameter(1);
+    Derivative r = b*exp(-1*a*t) - y;
+    std::cout << r << std::endl;
+
+    int n = 1000;
+    MatrixXd data(n, 2);
+    for(int lr = 0;lr < n;lr++){
+        double tt = lr*0.01;
+        data(lr, 0) = tt;
+        data(lr, 1) = 2*std::exp(-0.5*tt) + 0.01*std::sin(lr);
+    }
+
+    VectorXd x(2);
+    x << 0.4, 1.8;
+
+    DerivativeTape tape({r});
+    DerivativeWorkspace ws;
+
+    MatrixXd JtJ = MatrixXd::Zero(2, 2);
+    VectorXd Jtr = VectorXd::Zero(2);
+    double sum = 0;
+    auto accumulate = [&](int first, const Ref<const VectorXd>& res, const Ref<const MatrixXd>& J){
+        JtJ += J.transpose()*J;
+        Jtr += J.transpose()*res;
+        sum += res.squaredNorm();
+    };
+
+    tape.evaluateRows(x, data, 64, accumulate, ws);
+    std::cout << "rows " << sum << " " << Jtr.transpose() << " " << JtJ.row(0) << " " << JtJ.row(1) << std::endl;
+
+    // Same data from a binary file of row-major doubles,
+    // in a fresh file of the temporary directory
+    const char* tmp = std::getenv("TMPDIR");
+    std::string name = std::string(tmp ? tmp : "/tmp") + "/streaming_XXXXXX";
+    int fd = mkstemp(&name[0]);
+    if(fd < 0)
+        return 1;
+    const char* path = name.c_str();
+    FILE* file = fdopen(fd, "wb");
+    for(int lr = 0;lr < n;lr++)
+        std::fwrite(&data(lr, 0), sizeof(double), 1, file),
+        std::fwrite(&data(lr, 1), sizeof(double), 1, file);
+    std::fclose(file);
+
+    JtJ.setZero(), Jtr.setZero(), sum = 0;
+    bool ok = tape.evaluateFile(x, path, 2, 100, accumulate, ws);
+    std::cout << "file " << ok << " " << sum << " " << Jtr.transpose() << " " << JtJ.row(0) << " " << JtJ.row(1) << std::endl;
+    std::remove(path);
+
+    std::cout << "missing " << tape.evaluateFile(x, path, 2, 100, accumulate, ws) << std::endl;
+
+    // Against one graph for each row
+    JtJ.setZero(), Jtr.setZero(), sum = 0;
+    for(int lr = 0;lr < n;lr++){
+        Derivative ri = b*exp(-1*a*data(lr, 0)) - data(lr, 1);
+        Eigen::RowVector2d J(ri.diffPartial(0)(x), ri.diffPartial(1)(x));
+        JtJ += J.transpose()*J;
+        Jtr += J.transpose()*ri(x);
+        sum += ri(x)*ri(x);
+    }
+    std::cout << "graph " << sum << " " << Jtr.transpose() << " " << JtJ.row(0) << " " << JtJ.row(1) << std::endl;
+
+    return 0;
+}
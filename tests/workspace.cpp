@@ -0,0 +1,66 @@
+#include <iostream>
+#include <cstddef>
+#include "Derivative.h"
+
+// Count heap allocations by interposing glibc's malloc
+static long allocations = 0;
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* malloc(size_t size){
+    allocations++;
+    return __libc_malloc(size);
+}
+
+using Eigen::Map;
+using Eigen::MatrixXd;
+using Eigen::VectorXd;
+using Eigen::Derivative;
+using Eigen::DerivativeTape;
+using Eigen::DerivativeWorkspace;
+
+int main(){
+    Derivative x = Derivative::Variable(0),
+               y = Derivative::Variable(1);
+    Derivative f = x*y + exp(x), g = log(y)/x;
+
+    // Column, row, raw buffer with stride: no copy into VectorXd
+    MatrixXd points(2, 2);
+    points << 0.5, 0.2,
+              1.5, 0.4;
+    double buffer[4] = {0.5, -1, 1.5, -1};
+
+    std::cout << f(points.col(0)) << " "
+              << f(points.row(0).transpose()) << " "
+              << f(buffer, 2, 2) << std::endl;
+
+    // Reuse the buffers for every point
+    DerivativeTape tape({f, g});
+    DerivativeWorkspace ws;
+    VectorXd out(2);
+    MatrixXd J(2, 2);
+
+    for(int lp = 0;lp < points.cols();lp++){
+        tape.evaluate(points.col(lp), out, ws);
+        tape.jacobian(points.col(lp), J, ws);
+        std::cout << out.transpose() << std::endl;
+        std::cout << J << std::endl;
+        std::cout << g.diffPartial(0)(points.col(lp)) << " "
+                  << g.diffPartial(1)(points.col(lp)) << std::endl;
+    }
+
+    // No allocation once ws has been used with the tape
+    VectorXd w = VectorXd::Ones(2), grad(2);
+    MatrixXd H(2, 2);
+    tape.gradient(points.col(0), w, grad, ws);
+    tape.hessian(points.col(0), w, H, ws);
+
+    long before = allocations;
+    for(int lp = 0;lp < points.cols();lp++){
+        tape.evaluate(points.col(lp), out, ws);
+        tape.gradient(points.col(lp), w, grad, ws);
+        tape.jacobian(points.col(lp), J, ws);
+        tape.hessian(points.col(lp), w, H, ws);
+    }
+    std::cout << "allocations " << allocations - before << std::endl;
+
+    return allocations == before ? 0 : 1;
+}